@@ -0,0 +1,353 @@
+#include "bmpxx.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+
+// ============================================================
+// Allocation counting
+// ============================================================
+
+static std::atomic<uint64_t> allocation_count = 0;
+static std::atomic<uint64_t> allocation_bytes = 0;
+
+void *operator new(size_t size)
+{
+  allocation_count++;
+  allocation_bytes += size;
+  if (void *pointer = std::malloc(size ? size : 1))
+    return pointer;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *pointer) noexcept
+{
+  std::free(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept
+{
+  std::free(pointer);
+}
+
+// ============================================================
+// Synthetic images
+// ============================================================
+
+struct Layout
+{
+  const char *name;
+  uint16_t bits_per_pixel;
+  uint32_t compression;
+  uint32_t red_mask;
+  uint32_t green_mask;
+  uint32_t blue_mask;
+  uint32_t alpha_mask;
+  // How the decoded pixels are encoded again, none for layouts the encoder can not write
+  std::optional<bmpxx::EncodeFormat> encode_format;
+};
+
+static const Layout layouts[] = {
+    {"1bit", 1, 0, 0, 0, 0, 0, bmpxx::EncodeFormat::PALETTE},
+    // The encoder writes 4 colors as a 4 bit palette, so this layout has nothing of its own to encode
+    {"2bit", 2, 0, 0, 0, 0, 0, std::nullopt},
+    {"4bit", 4, 0, 0, 0, 0, 0, bmpxx::EncodeFormat::PALETTE},
+    {"8bit", 8, 0, 0, 0, 0, 0, bmpxx::EncodeFormat::PALETTE},
+    {"4bit_rle", 4, 2, 0, 0, 0, 0, bmpxx::EncodeFormat::RLE},
+    {"8bit_rle", 8, 1, 0, 0, 0, 0, bmpxx::EncodeFormat::RLE},
+    {"16bit_555", 16, 3, 0x7c00, 0x03e0, 0x001f, 0, bmpxx::EncodeFormat::RGB555},
+    {"16bit_565", 16, 3, 0xf800, 0x07e0, 0x001f, 0, bmpxx::EncodeFormat::RGB565},
+    {"16bit_4444", 16, 3, 0x0f00, 0x00f0, 0x000f, 0xf000, std::nullopt},
+    {"24bit_888", 24, 0, 0, 0, 0, 0, bmpxx::EncodeFormat::NATIVE},
+    {"32bit_888", 32, 3, 0x00ff0000, 0x0000ff00, 0x000000ff, 0, bmpxx::EncodeFormat::NATIVE},
+    {"32bit_8888", 32, 3, 0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000, bmpxx::EncodeFormat::NATIVE},
+};
+
+static uint32_t nextRandom(uint32_t &state)
+{
+  // xorshift32, fast and good enough to defeat any shortcut on flat data
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+static void write16(std::vector<uint8_t> &file, size_t offset, uint16_t value)
+{
+  std::memcpy(file.data() + offset, &value, 2);
+}
+
+static void write32(std::vector<uint8_t> &file, size_t offset, uint32_t value)
+{
+  std::memcpy(file.data() + offset, &value, 4);
+}
+
+// Run length encoded data is made by the encoder from runs of 1 to 64 pixels
+static std::vector<uint8_t> createRleImage(const Layout &layout, int32_t size, uint32_t &state)
+{
+  const uint32_t colors = 1u << layout.bits_per_pixel;
+
+  std::vector<uint8_t> pixels((size_t)size * size * 3);
+  uint32_t run = 0;
+  for (size_t pixel = 0; pixel < (size_t)size * size;)
+  {
+    // Consecutive runs walk through every palette color, so the encoder keeps the bit depth
+    const uint8_t index = (uint8_t)((run++ * 37) % colors);
+    const size_t length = std::min<size_t>(1 + nextRandom(state) % 64, (size_t)size * size - pixel);
+    for (size_t end = pixel + length; pixel < end; pixel++)
+    {
+      pixels[pixel * 3 + 0] = index;
+      pixels[pixel * 3 + 1] = (uint8_t)(255 - index);
+      pixels[pixel * 3 + 2] = (uint8_t)(index * 7);
+    }
+  }
+
+  bmpxx::EncodeOptions options;
+  options.format = bmpxx::EncodeFormat::RLE;
+  return bmpxx::bmp::encode(pixels, bmpxx::BmpDesc(size, size, 3), options);
+}
+
+static std::vector<uint8_t> createImage(const Layout &layout, int32_t size)
+{
+  uint32_t state = 0x12345678u ^ (uint32_t)size ^ layout.bits_per_pixel;
+
+  if (layout.compression == 1 || layout.compression == 2)
+    return createRleImage(layout, size, state);
+
+  const uint32_t colors = layout.bits_per_pixel <= 8 ? 1u << layout.bits_per_pixel : 0;
+  const uint32_t header_size = 14 + 108;
+  const uint32_t data_offset = header_size + colors * 4;
+  const uint32_t row_size = (((uint32_t)size * layout.bits_per_pixel + 31) / 32) * 4;
+  const uint32_t data_size = row_size * (uint32_t)size;
+
+  std::vector<uint8_t> file(data_offset + data_size);
+  file[0] = 'B';
+  file[1] = 'M';
+  write32(file, 2, (uint32_t)file.size());
+  write32(file, 10, data_offset);
+
+  // BITMAPV4HEADER, it holds all masks
+  write32(file, 14, 108);
+  write32(file, 18, (uint32_t)size);
+  write32(file, 22, (uint32_t)size);
+  write16(file, 26, 1);
+  write16(file, 28, layout.bits_per_pixel);
+  write32(file, 30, layout.compression);
+  write32(file, 34, data_size);
+  write32(file, 46, colors);
+  write32(file, 54, layout.red_mask);
+  write32(file, 58, layout.green_mask);
+  write32(file, 62, layout.blue_mask);
+  write32(file, 66, layout.alpha_mask);
+
+  for (uint32_t color = 0; color < colors; color++)
+    write32(file, header_size + color * 4, nextRandom(state) & 0x00ffffff);
+
+  // Random pixels, the row padding is part of it but never read
+  for (size_t offset = data_offset; offset + 4 <= file.size(); offset += 4)
+    write32(file, offset, nextRandom(state));
+
+  return file;
+}
+
+// ============================================================
+// Measuring
+// ============================================================
+
+struct Measurement
+{
+  uint64_t iterations = 0;
+  double seconds_per_op = 0;
+  double allocations_per_op = 0;
+  double allocated_bytes_per_op = 0;
+};
+
+template <typename Function>
+static Measurement measure(Function &&function, double min_seconds)
+{
+  // One untimed run warms the caches and the kernel selection
+  function();
+
+  const uint64_t start_count = allocation_count;
+  const uint64_t start_bytes = allocation_bytes;
+  const auto start = std::chrono::steady_clock::now();
+
+  Measurement measurement;
+  double elapsed = 0;
+  do
+  {
+    function();
+    measurement.iterations++;
+    elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  } while (elapsed < min_seconds);
+
+  measurement.seconds_per_op = elapsed / (double)measurement.iterations;
+  measurement.allocations_per_op = (double)(allocation_count - start_count) / (double)measurement.iterations;
+  measurement.allocated_bytes_per_op = (double)(allocation_bytes - start_bytes) / (double)measurement.iterations;
+  return measurement;
+}
+
+// Lets the peak resident set be measured per case instead of for the whole process
+static void resetPeakRss()
+{
+  std::ofstream clear_refs("/proc/self/clear_refs");
+  if (clear_refs)
+    clear_refs << "5";
+}
+
+static uint64_t peakRssKb()
+{
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line))
+    if (line.rfind("VmHWM:", 0) == 0)
+      return std::strtoull(line.c_str() + 6, nullptr, 10);
+
+  // Without procfs only the peak of the whole process is known
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (uint64_t)usage.ru_maxrss;
+}
+
+static void writeMeasurement(std::ostream &out, const Measurement &measurement, uint64_t pixels, uint64_t bytes)
+{
+  out << "{\"iterations\": " << measurement.iterations
+      << ", \"seconds_per_op\": " << measurement.seconds_per_op
+      << ", \"mb_per_s\": " << (double)bytes / measurement.seconds_per_op / 1e6
+      << ", \"pixels_per_s\": " << (double)pixels / measurement.seconds_per_op
+      << ", \"allocations_per_op\": " << measurement.allocations_per_op
+      << ", \"allocated_bytes_per_op\": " << measurement.allocated_bytes_per_op << "}";
+}
+
+static std::vector<std::string> splitList(const std::string &list)
+{
+  std::vector<std::string> items;
+  std::stringstream stream(list);
+  std::string item;
+  while (std::getline(stream, item, ','))
+    if (!item.empty())
+      items.push_back(item);
+  return items;
+}
+
+int main(int ac, char **av)
+{
+  std::vector<int32_t> sizes = {64, 1024, 8192};
+  std::vector<std::string> layout_names;
+  uint32_t threads = 1;
+  double min_seconds = 0.5;
+  std::string output_filename;
+
+  for (int i = 1; i < ac; i++)
+  {
+    const std::string argument = av[i];
+    if (i + 1 >= ac)
+    {
+      std::cerr << "Missing value for " << argument << std::endl;
+      return 1;
+    }
+
+    const std::string value = av[++i];
+    if (argument == "--sizes")
+    {
+      sizes.clear();
+      for (const auto &size : splitList(value))
+        sizes.push_back(std::stoi(size));
+    }
+    else if (argument == "--layouts")
+      layout_names = splitList(value);
+    else if (argument == "--threads")
+      threads = (uint32_t)std::stoul(value);
+    else if (argument == "--min-time")
+      min_seconds = std::stod(value);
+    else if (argument == "--output")
+      output_filename = value;
+    else
+    {
+      std::cerr << "Usage: " << av[0] << " [--sizes 64,1024,8192] [--layouts 8bit,24bit_888] [--threads 1] [--min-time 0.5] [--output results.json]" << std::endl;
+      return 1;
+    }
+  }
+
+  bmpxx::DecodeOptions decode_options;
+  decode_options.parallel.threads = threads;
+  bmpxx::EncodeOptions encode_options;
+  encode_options.parallel.threads = threads;
+
+  std::ostringstream json;
+  json << std::setprecision(6);
+  json << "{\n  \"threads\": " << threads << ",\n  \"min_seconds\": " << min_seconds << ",\n  \"results\": [";
+
+  bool first_result = true;
+  for (const auto &layout : layouts)
+  {
+    if (!layout_names.empty() && std::find(layout_names.begin(), layout_names.end(), layout.name) == layout_names.end())
+      continue;
+
+    for (const int32_t size : sizes)
+    {
+      const auto file = createImage(layout, size);
+      resetPeakRss();
+
+      // Throughput is counted in decoded pixel bytes, so every layout is comparable
+      auto decoded = bmpxx::bmp::decode(file, decode_options);
+      const uint64_t pixels = (uint64_t)size * size;
+      const uint64_t pixel_bytes = decoded.first.size();
+
+      const auto decode = measure([&]()
+                                  { bmpxx::bmp::decode(file, decode_options); },
+                                  min_seconds);
+
+      std::optional<Measurement> encode;
+      if (layout.encode_format)
+      {
+        auto options = encode_options;
+        options.format = *layout.encode_format;
+        encode = measure([&]()
+                         { bmpxx::bmp::encode(decoded.first, decoded.second, options); },
+                         min_seconds);
+      }
+
+      json << (first_result ? "\n" : ",\n");
+      first_result = false;
+
+      json << "    {\"layout\": \"" << layout.name << "\", \"width\": " << size << ", \"height\": " << size
+           << ", \"file_bytes\": " << file.size() << ", \"pixel_bytes\": " << pixel_bytes << ",\n     \"decode\": ";
+      writeMeasurement(json, decode, pixels, pixel_bytes);
+      json << ",\n     \"encode\": ";
+      if (encode)
+        writeMeasurement(json, *encode, pixels, pixel_bytes);
+      else
+        json << "null";
+      json << ",\n     \"peak_rss_kb\": " << peakRssKb() << "}";
+
+      std::cerr << layout.name << " " << size << "x" << size << " decode " << (double)pixel_bytes / decode.seconds_per_op / 1e6 << " MB/s" << std::endl;
+    }
+  }
+
+  json << "\n  ]\n}\n";
+
+  if (output_filename.empty())
+  {
+    std::cout << json.str();
+  }
+  else
+  {
+    std::ofstream output(output_filename);
+    output << json.str();
+  }
+
+  return 0;
+}
@@ -1,4 +1,12 @@
+#include <cstddef>
 #include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <span>
+#include <utility>
 #include <vector>
 
 #pragma once
@@ -10,10 +18,223 @@ namespace bmpxx
     int32_t width;
     int32_t height;
     uint8_t channels;
+    // Bits per channel, 8 or 16
+    uint8_t bit_depth;
 
-    BmpDesc(uint32_t width, uint32_t height, uint8_t channels)
-        : width(width), height(height), channels(channels) {}
-    BmpDesc() : width(0), height(0), channels(0) {}
+    BmpDesc(uint32_t width, uint32_t height, uint8_t channels, uint8_t bit_depth = 8)
+        : width(width), height(height), channels(channels), bit_depth(bit_depth) {}
+    BmpDesc() : width(0), height(0), channels(0), bit_depth(8) {}
+  };
+
+  // Bytes allocated from a memory resource without being initialized, given back to it when destroyed
+  class Buffer
+  {
+  public:
+    Buffer() = default;
+    Buffer(size_t size, std::pmr::memory_resource *memory_resource);
+    ~Buffer();
+    Buffer(Buffer &&other) noexcept;
+    Buffer &operator=(Buffer &&other) noexcept;
+    Buffer(const Buffer &) = delete;
+    Buffer &operator=(const Buffer &) = delete;
+
+    uint8_t *data() { return buffer_data; }
+    const uint8_t *data() const { return buffer_data; }
+    size_t size() const { return buffer_size; }
+    std::span<const uint8_t> span() const { return std::span<const uint8_t>(buffer_data, buffer_size); }
+
+  private:
+    void release();
+
+    uint8_t *buffer_data = nullptr;
+    size_t buffer_size = 0;
+    std::pmr::memory_resource *memory_resource = nullptr;
+  };
+
+  // Layout of the stored pixels of an image
+  enum class ChannelOrder
+  {
+    // Anything that needs masks or a palette to be read
+    OTHER,
+    BGR,
+    BGRX,
+    BGRA
+  };
+
+  // The stored pixel rows of an image, without any conversion
+  struct BmpView
+  {
+    int32_t width = 0;
+    int32_t height = 0;
+    uint16_t bits_per_pixel = 0;
+
+    // The top row
+    const uint8_t *pixels = nullptr;
+    // Bytes in a stored row, padding included
+    uint32_t stride = 0;
+    // Bytes from one row to the row below it, negative for bottom up images
+    std::ptrdiff_t row_step = 0;
+
+    ChannelOrder channel_order = ChannelOrder::OTHER;
+    uint32_t red_mask = 0;
+    uint32_t green_mask = 0;
+    uint32_t blue_mask = 0;
+    uint32_t alpha_mask = 0;
+
+    // BGRX entries, only set for palette images
+    const uint8_t *palette = nullptr;
+    uint32_t palette_size = 0;
+    // Bytes per palette entry, OS/2 1.x headers store BGR entries of 3 bytes
+    uint8_t palette_entry_size = 4;
+  };
+
+  // What an image in an OS/2 bitmap array is
+  enum class ArrayImageType
+  {
+    BITMAP,
+    // Icons and pointers with colors, only their color image is indexed and decoded
+    COLOR_ICON,
+    COLOR_POINTER,
+    // Monochrome icons and pointers, a single 1 bit image of twice the height holding both masks
+    ICON,
+    POINTER
+  };
+
+  // One image of an OS/2 bitmap array
+  struct ArrayEntry
+  {
+    ArrayImageType type = ArrayImageType::BITMAP;
+    int32_t width = 0;
+    int32_t height = 0;
+    uint16_t bits_per_pixel = 0;
+    // Display the image was made for, 0 when it suits any display
+    uint16_t display_width = 0;
+    uint16_t display_height = 0;
+    // Where the file header of the image starts
+    uint32_t offset = 0;
+  };
+
+  // Runs task(0) up to task(task_count - 1), possibly in parallel, and only returns once all are done
+  typedef std::function<void(uint32_t task_count, const std::function<void(uint32_t task)> &task)> Executor;
+
+  // Reads up to size bytes at offset into buffer, returns how many bytes were read
+  typedef std::function<size_t(uint64_t offset, uint8_t *buffer, size_t size)> ReadCallback;
+  // Writes size bytes from buffer at offset, returns how many bytes were written
+  typedef std::function<size_t(uint64_t offset, const uint8_t *buffer, size_t size)> WriteCallback;
+
+  // Tells the kernel how a mapped file is going to be read
+  enum class AccessHint
+  {
+    NORMAL,
+    SEQUENTIAL,
+    RANDOM
+  };
+
+  enum class RowOrder
+  {
+    TOP_DOWN,
+    BOTTOM_UP
+  };
+
+  struct ParallelOptions
+  {
+    // Number of bands the rows are split into, 0 uses every core
+    uint32_t threads = 1;
+    // Runs the bands instead of threads spawned by bmpxx when set
+    Executor executor = nullptr;
+    // Images with fewer pixels than this are always converted on the calling thread
+    uint64_t min_parallel_pixels = 1 << 20;
+  };
+
+  // Where the time of a single decode or encode call went, durations are in nanoseconds
+  struct Instrumentation
+  {
+    // readBMPHeader and readDIBHeader, or building the headers when encoding
+    uint64_t header_ns = 0;
+    // Mask or palette tables, or indexing the colors when encoding a palette
+    uint64_t table_ns = 0;
+    // Getting the output buffer
+    uint64_t allocation_ns = 0;
+    // The row loop
+    uint64_t row_ns = 0;
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    // How the rows were converted: "palette", "rle", "canonical", "masked", "native" or "packed"
+    const char *row_path = "";
+    // Instruction set of the vector kernel doing the bulk of every row: "avx2", "ssse3", "neon" or "scalar"
+    const char *kernel = "scalar";
+    // Bands the rows were split into
+    uint32_t threads = 1;
+  };
+
+  // Called once at the end of every call, BatchDecoder and BatchEncoder call it from their worker threads
+  typedef std::function<void(const Instrumentation &instrumentation)> InstrumentCallback;
+
+  // Layout of the decoded pixels, 8 bits per channel unless the name says otherwise
+  enum class PixelFormat
+  {
+    // RGB, or RGBA when the image has an alpha channel
+    NATIVE,
+    RGB8,
+    // Alpha is 255 when the image has none
+    RGBA8,
+    BGRA8,
+    // RGBA8 with the color channels multiplied by alpha
+    RGBA8_PREMULTIPLIED,
+    // A single BT.601 luma channel
+    GRAY8,
+    // Native endian uint16_t channels, masks keep all their bits and are rescaled to the full 16 bit range
+    RGB16,
+    // Alpha is 65535 when the image has none
+    RGBA16
+  };
+
+  // Rectangle of an image, x and y count from its top left pixel
+  struct Region
+  {
+    int32_t x = 0;
+    int32_t y = 0;
+    int32_t width = 0;
+    int32_t height = 0;
+  };
+
+  struct DecodeOptions
+  {
+    ParallelOptions parallel = ParallelOptions();
+    PixelFormat format = PixelFormat::NATIVE;
+    // Only these pixels are decoded and returned, an empty region is the whole image
+    Region region = Region();
+    // 1, 2, 4 or 8, every decoded pixel is the average of a block of downscale x downscale pixels of the region,
+    // blocks at the right and bottom edge average the pixels that are left, only for 8 bit formats
+    uint32_t downscale = 1;
+    // Decoding throws instead of allocating when the region has more pixels, or a run length encoded
+    // image has wider rows, since those files can declare any size without storing any rows for it
+    uint64_t max_pixels = 1 << 28;
+    // Nothing is measured when not set
+    InstrumentCallback instrument = nullptr;
+  };
+
+  // Pixel layout of the encoded file, alpha is only kept by NATIVE
+  enum class EncodeFormat
+  {
+    // 24 bit RGB, or 32 bit RGBA for 4 channel input
+    NATIVE,
+    // The smallest of 1, 4 or 8 bit that holds every color exactly, fails for more than 256 colors
+    PALETTE,
+    // Like PALETTE but run length encoded, 4 bit up to 16 colors and 8 bit above, always bottom up
+    RLE,
+    RGB565,
+    RGB555
+  };
+
+  struct EncodeOptions
+  {
+    ParallelOptions parallel = ParallelOptions();
+    EncodeFormat format = EncodeFormat::NATIVE;
+    // Order the rows are stored in, top down files have a negative height
+    RowOrder row_order = RowOrder::BOTTOM_UP;
+    // Nothing is measured when not set
+    InstrumentCallback instrument = nullptr;
   };
 
   class bmp
@@ -70,10 +291,11 @@ namespace bmpxx
       uint8_t blue_shift = 0;
       uint8_t alpha_shift = 0;
 
-      float red_scale = 0.0f;
-      float green_scale = 0.0f;
-      float blue_scale = 0.0f;
-      float alpha_scale = 0.0f;
+      // Maps a masked channel value straight to its 8 bit output value
+      uint8_t red_table[256] = {};
+      uint8_t green_table[256] = {};
+      uint8_t blue_table[256] = {};
+      uint8_t alpha_table[256] = {};
     };
 
     struct RgbaColor
@@ -84,10 +306,120 @@ namespace bmpxx
       uint8_t alpha;
     };
 
+    // Vectorized row kernels return how many pixels they converted,
+    // the scalar code then finishes the rest of the row
+    typedef int32_t (*RowKernel)(const uint8_t *input_ptr, uint8_t *output_ptr, int32_t width);
+
+    struct RowKernels
+    {
+      RowKernel swizzle_3_to_3 = nullptr;
+      RowKernel swizzle_4_to_4 = nullptr;
+      RowKernel swizzle_4_to_3 = nullptr;
+      RowKernel unpack_565 = nullptr;
+      RowKernel unpack_555 = nullptr;
+      RowKernel pack_3_to_565 = nullptr;
+      RowKernel pack_4_to_565 = nullptr;
+      RowKernel pack_3_to_555 = nullptr;
+      RowKernel pack_4_to_555 = nullptr;
+
+      // 32 bit 10:10:10:2 to RGB16, RGBA16 and RGBA16 without a stored alpha
+      RowKernel unpack_1010102_to_3 = nullptr;
+      RowKernel unpack_1010102_to_4 = nullptr;
+      RowKernel unpack_1010102_to_4_opaque = nullptr;
+
+      // Instruction set of the swizzle, unpack and pack kernels, only reported to instrumentation
+      const char *swizzle_isa = "scalar";
+      const char *unpack_isa = "scalar";
+      const char *pack_isa = "scalar";
+    };
+
+    // Reads the clock only when enabled, lap gives the nanoseconds since the previous lap
+    class StageTimer
+    {
+    public:
+      explicit StageTimer(bool enabled);
+      uint64_t lap() { return enabled ? elapsed() : 0; }
+
+    private:
+      uint64_t elapsed();
+
+      bool enabled;
+      uint64_t last_ns = 0;
+    };
+
     struct DibHeaderMeta
     {
       uint32_t padded_row_width = 0;
       uint8_t has_alpha_channel = 0;
+      // Plain 8 bit BGR(A) channels, so rows can be swizzled without masking
+      uint8_t has_canonical_masks = 0;
+      // The stored height was negative, the first row in the file is the top row
+      uint8_t is_top_down = 0;
+      // OS/2 1.x headers have BGR palette entries without the unused byte
+      uint8_t palette_entry_size = 4;
+    };
+
+    // Masks of 16 bit formats, channels wider than 16 bits keep their top 16 bits
+    struct WideMasks
+    {
+      // Red, green, blue and alpha
+      uint32_t mask[4] = {0, 0, 0, 0};
+      uint8_t shift[4] = {0, 0, 0, 0};
+      // round(value * 65535 / mask) is (value * multiplier + 2^31) >> 32
+      uint64_t multiplier[4] = {0, 0, 0, 0};
+    };
+
+    struct RowDecoder;
+
+    // Converts pixels of a stored row straight into the output pixel format
+    typedef void (*PixelRow)(const uint8_t *row_ptr, uint8_t *output_ptr, int32_t width, const RowDecoder &row_decoder);
+
+    // Everything needed to convert one stored row, prepared once per image
+    struct RowDecoder
+    {
+      uint16_t bits_per_pixel = 0;
+      int32_t width = 0;
+      // Bytes per decoded pixel
+      uint8_t channels = 0;
+
+      // Converts the bulk of the row when set, pixel_row finishes the rest
+      // Byte of the stored row the decoded columns start in, and the palette pixels in it before them
+      size_t first_byte = 0;
+      uint32_t skipped_pixels = 0;
+
+      RowKernel vector_row = nullptr;
+      PixelRow pixel_row = nullptr;
+      DecodedRgbaMasks masks = DecodedRgbaMasks();
+      WideMasks wide_masks = WideMasks();
+      // Palettes and 8 bit channels of 16 bit formats are decoded at 8 bits and widened afterwards
+      bool widen = false;
+      // Only reported to instrumentation
+      const char *row_path = "";
+      const char *kernel = "scalar";
+
+      // Maps every possible source byte to the decoded pixels in it, only used for palettes
+      uint8_t byte_table[256 * 8 * 4];
+    };
+
+    // Averages blocks of decoded pixels with integer sums, fed one decoded row at a time
+    struct RowDownscaler
+    {
+      RowDownscaler(int32_t width, uint8_t channels, uint32_t downscale);
+
+      void addRow(const uint8_t *row_ptr);
+      // Writes the averages of the rows added since the last flush
+      void flush(uint8_t *output_ptr);
+
+      int32_t width;
+      uint8_t channels;
+      int32_t downscale;
+      int32_t rows = 0;
+      // Sums the columns of every block and writes the averages, picked once for the channels and downscale
+      void (*flush_row)(uint16_t *column_sums, int32_t width, int32_t rows, uint8_t *output_ptr) = nullptr;
+      // Up to 8 x 255 per channel of every pixel in a row, the columns are only summed once per block
+      std::vector<uint16_t> column_sums;
+      // Scratch for a single full size decoded row
+      std::vector<uint8_t> row;
     };
 
     // ============================================================
@@ -117,6 +449,17 @@ namespace bmpxx
       uint32_t data_offset = 0;
     };
 
+    // Starts every entry of an OS/2 bitmap array, followed by the file header of its image
+    struct __attribute__((packed)) ArrayHeader
+    {
+      char identifier[2] = {'B', 'A'};
+      uint32_t header_size = 0;
+      // From the start of the file, 0 for the last entry
+      uint32_t next_offset = 0;
+      uint16_t display_width = 0;
+      uint16_t display_height = 0;
+    };
+
     struct __attribute__((packed)) RgbMasks
     {
       uint32_t red_mask = 0;
@@ -197,41 +540,339 @@ namespace bmpxx
       }
     };
 
+    // Everything a decode call knows about the image before it gets the output
+    struct PreparedDecode
+    {
+      // The headers of array entries are read from their own file header on
+      std::span<const uint8_t> input_image;
+      BmpHeader bmp_header = BmpHeader();
+      DibDecodeHeader dib_header = DibDecodeHeader();
+      BmpDesc description;
+      // Bytes of a decoded row without any padding
+      size_t row_size = 0;
+      Instrumentation instrumentation;
+      StageTimer timer = StageTimer(false);
+    };
+
     // ============================================================
     // Private Methods
     // ============================================================
 
     // Decode
 
-    static std::pair<std::vector<uint8_t>, BmpDesc> decodePalette(
-        std::vector<uint8_t> inputImage,
+    // Reads the headers and describes the decoded image, timing it when instrumented, entry is only given for images in an array
+    static PreparedDecode prepareDecode(std::span<const uint8_t> inputImage, const DecodeOptions &options, const ArrayEntry *entry = nullptr);
+    // The description of the decoded region, which is the whole image by default, throws when the region has more than max_pixels
+    // or the rows of a run length encoded image are wider than that
+    static BmpDesc describeImage(DibDecodeHeader *dib_header, PixelFormat format, const Region &region = Region(), uint32_t downscale = 1, uint64_t max_pixels = UINT64_MAX);
+    // An empty region becomes the whole image, throws when it does not fit in the image
+    static Region resolveRegion(DibDecodeHeader *dib_header, const Region &region);
+    // NATIVE becomes RGB8 or RGBA8, depending on the image
+    static PixelFormat resolvePixelFormat(DibDecodeHeader *dib_header, PixelFormat format);
+    static uint8_t pixelFormatChannels(PixelFormat format);
+    static bool isWideFormat(PixelFormat format);
+    // The 8 bit format with the same channels
+    static PixelFormat narrowFormat(PixelFormat format);
+    static void decodePixels(
+        std::span<const uint8_t> inputImage,
         BmpHeader *bmp_header,
-        DibDecodeHeader *dib_header);
-    static std::pair<std::vector<uint8_t>, BmpDesc> decodeNormal(
-        std::vector<uint8_t> inputImage,
+        DibDecodeHeader *dib_header,
+        uint8_t *output,
+        size_t output_stride,
+        const DecodeOptions &options,
+        const DecodedRgbaMasks *masks = nullptr,
+        Instrumentation *instrumentation = nullptr);
+    // The format has to be resolved already, masks are decoded from the header when not given
+    static void prepareRowDecoder(
+        std::span<const uint8_t> inputImage,
+        DibDecodeHeader *dib_header,
+        PixelFormat format,
+        RowDecoder *row_decoder,
+        const DecodedRgbaMasks *masks = nullptr);
+    // Only for 16 bit formats of images with masks other than 8 bit BGR(A)
+    static void prepareWideRowDecoder(DibDecodeHeader *dib_header, PixelFormat format, RowDecoder *row_decoder);
+    static void decodeRow(const RowDecoder &row_decoder, const uint8_t *row_ptr, uint8_t *output_ptr);
+    static PixelRow selectPaletteRow(uint32_t bits_per_pixel, uint8_t channels);
+    template <uint32_t BitsPerPixel, uint8_t Channels>
+    static void decodePaletteRow(const uint8_t *row_ptr, uint8_t *output_ptr, int32_t width, const RowDecoder &row_decoder);
+    // Writes 256 colors in the given format, every one of them pixelFormatChannels bytes
+    static void fillPaletteColors(std::span<const uint8_t> inputImage, DibDecodeHeader *dib_header, PixelFormat format, uint8_t *colors);
+    static void fillPaletteByteTable(uint32_t bits_per_pixel, uint8_t channels, const uint8_t *colors, uint8_t *byte_table);
+    static void decodeRle(
+        std::span<const uint8_t> inputImage,
         BmpHeader *bmp_header,
-        DibDecodeHeader *dib_header);
+        DibDecodeHeader *dib_header,
+        PixelFormat format,
+        const Region &region,
+        uint32_t downscale,
+        uint8_t *output,
+        size_t output_stride);
+    template <uint8_t Channels, int32_t Downscale>
+    static void flushDownscaleRow(uint16_t *column_sums, int32_t width, int32_t rows, uint8_t *output_ptr);
+    template <uint8_t Channels>
+    static void (*selectDownscaleRow(uint32_t downscale))(uint16_t *column_sums, int32_t width, int32_t rows, uint8_t *output_ptr);
+    static void fillPattern(uint8_t *output_ptr, size_t pattern_size, size_t total_size);
+    template <PixelFormat Format>
+    static PixelRow selectPixelRow(uint32_t bytes_per_pixel, bool has_alpha_channel, bool has_canonical_masks);
+    template <uint32_t BytesPerPixel, PixelFormat Format, bool HasAlpha>
+    static void decodeCanonicalRow(const uint8_t *row_ptr, uint8_t *output_ptr, int32_t width, const RowDecoder &row_decoder);
+    template <uint32_t BytesPerPixel, PixelFormat Format, bool HasAlpha>
+    static void decodeMaskedRow(const uint8_t *row_ptr, uint8_t *output_ptr, int32_t width, const RowDecoder &row_decoder);
+    template <PixelFormat Format>
+    static void storePixel(uint8_t *output_ptr, uint8_t red, uint8_t green, uint8_t blue, uint8_t alpha);
+    static void storePixel(PixelFormat format, uint8_t *output_ptr, uint8_t red, uint8_t green, uint8_t blue, uint8_t alpha);
+    template <uint32_t BytesPerPixel, uint8_t Channels, bool HasAlpha>
+    static void decodeWideRow(const uint8_t *row_ptr, uint8_t *output_ptr, int32_t width, const RowDecoder &row_decoder);
+    // Turns the first values bytes of the row into as many uint16_t, in place
+    static void widenRow(uint8_t *row_ptr, size_t values);
     static DecodedRgbaMasks decodeMasks(DibDecodeHeader *dib_header);
+    static WideMasks decodeWideMasks(DibDecodeHeader *dib_header);
+    static void fillScaleTable(uint8_t *table, uint8_t mask);
 
-    static BmpHeader readBMPHeader(std::vector<uint8_t> inputImage);
-    static uint32_t readDIBHeaderSize(std::vector<uint8_t> inputImage, BmpHeader *bmp_header);
-    static DibDecodeHeader readDIBHeader(std::vector<uint8_t> inputImage, BmpHeader *bmp_header);
+    // The span has to hold at least the headers and palette, file_size is the size of the whole file
+    static BmpHeader readBMPHeader(std::span<const uint8_t> inputImage, uint64_t file_size);
+    static uint32_t readDIBHeaderSize(std::span<const uint8_t> inputImage, uint64_t file_size, BmpHeader *bmp_header);
+    static DibDecodeHeader readDIBHeader(std::span<const uint8_t> inputImage, uint64_t file_size, BmpHeader *bmp_header);
 
     static void fixDIBHeaderDataSize(DibDecodeHeader *dib_header);
-    static void fixDIBHeaderCompression(std::vector<uint8_t> inputImage, DibDecodeHeader *dib_header);
+    static void fixDIBHeaderCompression(std::span<const uint8_t> inputImage, DibDecodeHeader *dib_header);
     static void fixDIBHeaderMasks(DibDecodeHeader *dib_header);
 
+    // Reads the headers of the image whose file header is at offset, pixel offsets in arrays count from the start of the file,
+    // so the returned span starts at the file header and the data offset is moved to count from there
+    static std::span<const uint8_t> readArrayEntry(
+        std::span<const uint8_t> inputArray,
+        uint32_t offset,
+        BmpHeader *bmp_header,
+        DibDecodeHeader *dib_header);
+
     // Encode
 
-    static DibEncodeHeader createEncodeDibHeader(BmpDesc desc);
+    template <uint8_t Channels>
+    static void encodeRow(const uint8_t *input_ptr, uint8_t *output_ptr, int32_t width);
+    template <uint8_t Channels, bool Is565>
+    static void encodePackedRow(const uint8_t *input_ptr, uint8_t *output_ptr, int32_t width);
+    // Palettes are encoded by encodePalette instead
+    static void encodePixelRow(const uint8_t *input_ptr, uint8_t *output_ptr, const BmpDesc &desc, EncodeFormat format);
+    // Gives the memory for an encoded file of the given size, its contents do not have to be initialized
+    typedef std::function<uint8_t *(size_t size)> AllocateOutput;
+
+    static void encodeTo(std::span<const uint8_t> input, BmpDesc desc, const EncodeOptions &options, const AllocateOutput &allocate_output);
+    static void encodePalette(std::span<const uint8_t> input, BmpDesc desc, const EncodeOptions &options, const AllocateOutput &allocate_output);
+    // Gives every pixel its palette index, returns the amount of colors or throws when there are more than 256
+    template <uint8_t Channels>
+    static uint32_t indexColors(const uint8_t *input_ptr, size_t pixel_count, uint8_t *indices, RgbaColor *palette);
+    template <uint32_t BitsPerPixel>
+    static void encodeIndexRow(const uint8_t *indices, uint8_t *output_ptr, int32_t width);
+    // Appends the run length encoded rows, bottom row first, and the end of bitmap marker to output
+    static void encodeRle(const uint8_t *indices, BmpDesc desc, bool is_rle4, std::vector<uint8_t> &output);
+    // Length of the run of equal indices starting at x, up to end
+    static int32_t findRun(const uint8_t *indices, int32_t x, int32_t end);
+    // colors_used is only used for PALETTE
+    static DibEncodeHeader createEncodeDibHeader(BmpDesc desc, EncodeFormat format, RowOrder row_order, uint32_t colors_used = 0);
+    // Headers, palette and data_size bytes of pixels, which has to fit in the 32 bit file size
+    static uint64_t encodedFileSize(const DibEncodeHeader *dib_header, uint64_t data_size);
+    // Writes the bmp and DIB header, output needs room for sizeof(BmpHeader) + header_size bytes
+    static void writeEncodeHeaders(DibEncodeHeader *dib_header, uint8_t *output);
 
     // Shared
 
     static DibHeaderMeta createDIBHeaderMeta(Dib56Header *dib_header);
+    // Picks the fastest kernels this cpu supports, only done once
+    static const RowKernels &selectRowKernels();
+    // Threads, buffers and mask tables shared by all images of a BatchDecoder or BatchEncoder
+    struct BatchPool;
+    // Splits the rows into bands and converts them in parallel when the image is large enough
+    // Returns the amount of bands the rows were split into
+    static uint32_t runRowBands(
+        const ParallelOptions &options,
+        int32_t rows,
+        int32_t row_pixels,
+        const std::function<void(int32_t first_row, int32_t end_row)> &band);
+    // Fills in the byte counts and hands the instrumentation to the callback
+    static void reportInstrumentation(const InstrumentCallback &instrument, Instrumentation &instrumentation, uint64_t bytes_in, uint64_t bytes_out);
 
   public:
-    static std::pair<std::vector<uint8_t>, BmpDesc> decode(std::vector<uint8_t> inputImage);
-    static std::vector<uint8_t> encode(std::vector<uint8_t> input, BmpDesc desc);
+    static std::pair<std::vector<uint8_t>, BmpDesc> decode(
+        std::span<const uint8_t> inputImage,
+        const DecodeOptions &options = DecodeOptions());
+    static std::pair<std::vector<uint8_t>, BmpDesc> decode(
+        const std::vector<uint8_t> &inputImage,
+        const DecodeOptions &options = DecodeOptions());
+    // Decodes into memory from the resource, which is not zero initialized first
+    static std::pair<Buffer, BmpDesc> decode(
+        std::span<const uint8_t> inputImage,
+        std::pmr::memory_resource *memory_resource,
+        const DecodeOptions &options = DecodeOptions());
+
+    // Parses only the headers, returns the description and the decoded byte count
+    static std::pair<BmpDesc, size_t> probe(
+        std::span<const uint8_t> inputImage,
+        const DecodeOptions &options = DecodeOptions());
+    // Validates the headers and points into the stored rows, nothing is converted or copied
+    static BmpView view(std::span<const uint8_t> inputImage);
+    // Decodes into a caller owned buffer, a stride of 0 means tightly packed rows
+    static BmpDesc decodeInto(
+        std::span<const uint8_t> inputImage,
+        std::span<uint8_t> output,
+        size_t stride = 0,
+        const DecodeOptions &options = DecodeOptions());
+
+    static std::vector<uint8_t> encode(
+        std::span<const uint8_t> input,
+        BmpDesc desc,
+        const EncodeOptions &options = EncodeOptions());
+    static std::vector<uint8_t> encode(
+        const std::vector<uint8_t> &input,
+        BmpDesc desc,
+        const EncodeOptions &options = EncodeOptions());
+    // Encodes into memory from the resource, which is not zero initialized first
+    static Buffer encode(
+        std::span<const uint8_t> input,
+        BmpDesc desc,
+        std::pmr::memory_resource *memory_resource,
+        const EncodeOptions &options = EncodeOptions());
+
+    // Walks the entries of an OS/2 bitmap array once and validates their headers, nothing is decoded,
+    // any other bmp file gives a single entry
+    static std::vector<ArrayEntry> indexArray(std::span<const uint8_t> inputArray);
+    // Index of the entry closest to width x height, ties go to the higher bit depth and then the earlier entry
+    static size_t findArrayEntry(std::span<const ArrayEntry> entries, int32_t width, int32_t height);
+    // Decodes a single entry straight from the array, the other entries are never touched
+    static std::pair<std::vector<uint8_t>, BmpDesc> decodeArrayEntry(
+        std::span<const uint8_t> inputArray,
+        const ArrayEntry &entry,
+        const DecodeOptions &options = DecodeOptions());
+
+    // Maps a whole file read only, decoders can use data() without the file ever being copied
+    class MappedFile
+    {
+    public:
+      explicit MappedFile(const std::string &path, AccessHint hint = AccessHint::SEQUENTIAL);
+      ~MappedFile();
+
+      MappedFile(MappedFile &&other) noexcept;
+      MappedFile &operator=(MappedFile &&other) noexcept;
+      MappedFile(const MappedFile &) = delete;
+      MappedFile &operator=(const MappedFile &) = delete;
+
+      std::span<const uint8_t> data() const;
+
+    private:
+      const uint8_t *mapping = nullptr;
+      size_t mapping_size = 0;
+    };
+
+    // Decodes a bmp file straight from a read only mapping of it
+    static std::pair<std::vector<uint8_t>, BmpDesc> decodeFile(
+        const std::string &path,
+        const DecodeOptions &options = DecodeOptions());
+
+    // Decodes one row at a time straight from a file, so only the headers and a single row are kept in memory
+    class StreamDecoder
+    {
+    public:
+      StreamDecoder(ReadCallback read_callback, uint64_t file_size, PixelFormat format = PixelFormat::NATIVE);
+      explicit StreamDecoder(std::istream &stream, PixelFormat format = PixelFormat::NATIVE);
+      explicit StreamDecoder(int fd, PixelFormat format = PixelFormat::NATIVE);
+
+      BmpDesc description() const;
+      // Size in bytes of a single decoded row
+      size_t rowSize() const;
+
+      // Decodes the next row, starting at the top, returns false once every row has been read
+      bool readRow(std::span<uint8_t> output);
+      // Decodes any row, 0 is the top row
+      void readRow(int32_t y, std::span<uint8_t> output);
+
+    private:
+      void readHeaders();
+
+      ReadCallback read_callback;
+      uint64_t file_size = 0;
+      PixelFormat format = PixelFormat::NATIVE;
+
+      BmpHeader bmp_header = BmpHeader();
+      DibDecodeHeader dib_header = DibDecodeHeader();
+      BmpDesc desc = BmpDesc();
+
+      std::unique_ptr<RowDecoder> row_decoder;
+      std::vector<uint8_t> row_buffer;
+      int32_t next_row = 0;
+    };
+
+    // Encodes one row at a time straight into a file, the headers are written up front
+    // and every row goes to its final position, so only a single row is kept in memory
+    class StreamEncoder
+    {
+    public:
+      StreamEncoder(WriteCallback write_callback, BmpDesc desc, RowOrder order = RowOrder::TOP_DOWN);
+      StreamEncoder(std::ostream &stream, BmpDesc desc, RowOrder order = RowOrder::TOP_DOWN);
+      StreamEncoder(int fd, BmpDesc desc, RowOrder order = RowOrder::TOP_DOWN);
+
+      // Size in bytes of a single input row
+      size_t rowSize() const;
+      // Size in bytes of the complete file
+      uint64_t fileSize() const;
+
+      // Encodes the next row in the order given to the constructor, returns false once every row has been written
+      bool writeRow(std::span<const uint8_t> input);
+      // Encodes any row, 0 is the top row
+      void writeRow(int32_t y, std::span<const uint8_t> input);
+
+    private:
+      void writeHeaders();
+
+      WriteCallback write_callback;
+      BmpDesc desc = BmpDesc();
+      RowOrder order = RowOrder::TOP_DOWN;
+
+      DibEncodeHeader dib_header = DibEncodeHeader();
+      uint32_t data_offset = 0;
+
+      std::vector<uint8_t> row_buffer;
+      int32_t rows_written = 0;
+    };
+
+    // Decodes many images at once on threads that live as long as the decoder,
+    // decoded buffers can be handed back to be reused by later batches
+    class BatchDecoder
+    {
+    public:
+      // 0 threads uses every core, the parallel options are not used since every image is decoded on one thread
+      explicit BatchDecoder(uint32_t threads = 0, const DecodeOptions &options = DecodeOptions());
+      ~BatchDecoder();
+      BatchDecoder(const BatchDecoder &) = delete;
+      BatchDecoder &operator=(const BatchDecoder &) = delete;
+
+      // Results are in input order, throws the error of the first image that failed once all are done
+      std::vector<std::pair<std::vector<uint8_t>, BmpDesc>> decode(std::span<const std::span<const uint8_t>> inputs);
+      void recycle(std::vector<uint8_t> &&buffer);
+
+    private:
+      DecodeOptions options;
+      std::unique_ptr<BatchPool> pool;
+    };
+
+    // Encodes many images at once on threads that live as long as the encoder,
+    // encoded buffers can be handed back to be reused by later batches
+    class BatchEncoder
+    {
+    public:
+      // 0 threads uses every core, the parallel options are not used since every image is encoded on one thread
+      explicit BatchEncoder(uint32_t threads = 0, const EncodeOptions &options = EncodeOptions());
+      ~BatchEncoder();
+      BatchEncoder(const BatchEncoder &) = delete;
+      BatchEncoder &operator=(const BatchEncoder &) = delete;
+
+      // Results are in input order, throws the error of the first image that failed once all are done
+      std::vector<std::vector<uint8_t>> encode(std::span<const std::pair<std::span<const uint8_t>, BmpDesc>> inputs);
+      void recycle(std::vector<uint8_t> &&buffer);
+
+    private:
+      EncodeOptions options;
+      std::unique_ptr<BatchPool> pool;
+    };
   };
 
   // Decode
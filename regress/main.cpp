@@ -0,0 +1,276 @@
+#include "bmpxx.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/mman.h>
+
+// Small checks for bugs that were fixed, every one of them runs on its own so a crash points at its name
+namespace
+{
+  int failures = 0;
+
+  void check(bool condition, const std::string &name, const std::string &what)
+  {
+    if (!condition)
+    {
+      std::cerr << "FAILED " << name << ": " << what << std::endl;
+      failures++;
+    }
+  }
+
+  void run(const std::string &name, const std::function<void(const std::string &name)> &test)
+  {
+    try
+    {
+      test(name);
+    }
+    catch (const std::exception &exception)
+    {
+      check(false, name, std::string("threw ") + exception.what());
+    }
+  }
+
+  std::vector<uint8_t> makePixels(int32_t width, int32_t height, uint8_t channels)
+  {
+    std::vector<uint8_t> pixels((size_t)width * height * channels);
+    for (size_t i = 0; i < pixels.size(); i++)
+      pixels[i] = (uint8_t)(i * 7 + i / 13);
+    return pixels;
+  }
+
+  void write16(std::vector<uint8_t> &file, size_t offset, uint32_t value)
+  {
+    file[offset] = (uint8_t)value;
+    file[offset + 1] = (uint8_t)(value >> 8);
+  }
+
+  void write32(std::vector<uint8_t> &file, size_t offset, uint32_t value)
+  {
+    for (size_t i = 0; i < 4; i++)
+      file[offset + i] = (uint8_t)(value >> (8 * i));
+  }
+
+  // A file with a 40 byte header and nothing but size bytes after it, pixel data starts right after the header
+  std::vector<uint8_t> makeHeaderOnlyFile(int32_t width, int32_t height, uint16_t bits_per_pixel, uint32_t compression, size_t size)
+  {
+    std::vector<uint8_t> file(54 + size, 0);
+    file[0] = 'B';
+    file[1] = 'M';
+    write32(file, 2, (uint32_t)file.size());
+    write32(file, 10, 54);
+    write32(file, 14, 40);
+    write32(file, 18, (uint32_t)width);
+    write32(file, 22, (uint32_t)height);
+    write16(file, 26, 1);
+    write16(file, 28, bits_per_pixel);
+    write32(file, 30, compression);
+    return file;
+  }
+
+  // A run length encoded file with a palette of 256 colors followed by a single end of bitmap marker
+  std::vector<uint8_t> makeEmptyRleFile(int32_t width, int32_t height)
+  {
+    auto file = makeHeaderOnlyFile(width, height, 8, 1, 256 * 4 + 2);
+    write32(file, 10, 54 + 256 * 4);
+    write32(file, 46, 256);
+    file[file.size() - 1] = 1;
+    return file;
+  }
+
+  template <typename Call>
+  void checkThrows(const std::string &name, const std::string &what, const Call &call)
+  {
+    try
+    {
+      call();
+      check(false, name, what + " did not throw");
+    }
+    catch (const std::exception &)
+    {
+    }
+  }
+
+  // 65536 x 65536 x 4 bytes wrapped to 0 in 32 bits, so a header only file passed as a huge image
+  // and a region decode read gigabytes past the input
+  void wrappedImageSize(const std::string &name)
+  {
+    const auto file = makeHeaderOnlyFile(65536, 65536, 32, 0, 16);
+
+    std::vector<uint8_t> output(4);
+    bmpxx::DecodeOptions options;
+    options.region = bmpxx::Region{0, 0, 1, 1};
+    checkThrows(name, "decodeInto", [&]
+                { bmpxx::bmp::decodeInto(file, output, 0, options); });
+    checkThrows(name, "probe", [&]
+                { bmpxx::bmp::probe(file); });
+    checkThrows(name, "view", [&]
+                { bmpxx::bmp::view(file); });
+  }
+
+  // Run length encoded rows are not stored for every pixel, so a tiny file could make decode allocate hundreds of gigabytes
+  void hugeRleImage(const std::string &name)
+  {
+    const auto file = makeEmptyRleFile(300000, 300000);
+
+    checkThrows(name, "decode", [&]
+                { bmpxx::bmp::decode(std::span<const uint8_t>(file)); });
+
+    // Still fine as long as the decoded region stays under the limit
+    bmpxx::DecodeOptions options;
+    options.region = bmpxx::Region{0, 0, 16, 16};
+    const auto result = bmpxx::bmp::decode(std::span<const uint8_t>(file), options);
+    check(result.first.size() == 16 * 16 * 3, name, "small region of a huge image");
+
+    // Stored rows are decoded whole, so a region can't make a huge width fit
+    const auto wide_file = makeEmptyRleFile(INT32_MAX, 16);
+    options.region = bmpxx::Region{0, 0, 1, 1};
+    try
+    {
+      bmpxx::bmp::decode(std::span<const uint8_t>(wide_file), options);
+      check(false, name, "small region of a huge width did not throw");
+    }
+    catch (const std::bad_alloc &)
+    {
+      check(false, name, "small region of a huge width was allocated");
+    }
+    catch (const std::runtime_error &)
+    {
+    }
+
+    // Rows that are never stored cost nothing, however many of them are declared
+    const auto tall_file = makeEmptyRleFile(16, INT32_MAX);
+    const auto tall_result = bmpxx::bmp::decode(std::span<const uint8_t>(tall_file), options);
+    check(tall_result.first.size() == 3, name, "small region of a huge height");
+  }
+
+  // Rows below a region were walked one by one, so a region at the top of a tall image took seconds
+  void rleRowsBelowRegion(const std::string &name)
+  {
+    const auto file = makeEmptyRleFile(16, INT32_MAX);
+
+    bmpxx::DecodeOptions options;
+    options.region = bmpxx::Region{0, 0, 16, 16};
+    const auto start = std::chrono::steady_clock::now();
+    const auto result = bmpxx::bmp::decode(std::span<const uint8_t>(file), options);
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+
+    check(result.first.size() == 16 * 16 * 3, name, "region of a tall image");
+    check(elapsed < std::chrono::milliseconds(500), name, "rows below the region were not skipped");
+  }
+
+  // Empty palettes read as full ones and empty run length encoded data had no end of bitmap
+  void emptyEncode(const std::string &name)
+  {
+    for (auto format : {bmpxx::EncodeFormat::NATIVE, bmpxx::EncodeFormat::PALETTE, bmpxx::EncodeFormat::RLE})
+    {
+      bmpxx::EncodeOptions options;
+      options.format = format;
+      for (const auto &desc : {bmpxx::BmpDesc(0, 4, 3), bmpxx::BmpDesc(4, 0, 4)})
+        checkThrows(name, "encode", [&]
+                    { bmpxx::bmp::encode(std::vector<uint8_t>(), desc, options); });
+    }
+
+    std::ostringstream stream;
+    checkThrows(name, "StreamEncoder", [&]
+                { bmpxx::bmp::StreamEncoder(stream, bmpxx::BmpDesc(4, 0, 3)); });
+  }
+
+  // The data size of the headers wrapped in 32 bits, so a valid input larger than 4 GB got an undersized output
+  void oversizedEncode(const std::string &name)
+  {
+    const bmpxx::BmpDesc desc(32768, 32769, 4);
+    const size_t input_size = (size_t)desc.width * desc.height * desc.channels;
+
+    // Never touched, the size checks have to throw before any pixel is read
+    void *input = mmap(nullptr, input_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (input == MAP_FAILED)
+      return;
+
+    const std::span<const uint8_t> input_span(static_cast<const uint8_t *>(input), input_size);
+    checkThrows(name, "encode", [&]
+                { bmpxx::bmp::encode(input_span, desc); });
+    munmap(input, input_size);
+
+    std::ostringstream stream;
+    checkThrows(name, "StreamEncoder", [&]
+                { bmpxx::bmp::StreamEncoder(stream, desc); });
+    check(stream.str().empty(), name, "StreamEncoder wrote before throwing");
+  }
+
+  // Top down rows used to be written past the end of string streams, which can't seek there
+  void streamEncoderToStringStream(const std::string &name)
+  {
+    for (auto order : {bmpxx::RowOrder::TOP_DOWN, bmpxx::RowOrder::BOTTOM_UP})
+    {
+      const bmpxx::BmpDesc desc(13, 7, 3);
+      const auto pixels = makePixels(desc.width, desc.height, desc.channels);
+
+      std::ostringstream stream;
+      bmpxx::bmp::StreamEncoder encoder(stream, desc, order);
+      for (int32_t row = 0; row < desc.height; row++)
+      {
+        const int32_t y = order == bmpxx::RowOrder::TOP_DOWN ? row : desc.height - 1 - row;
+        encoder.writeRow(std::span<const uint8_t>(pixels.data() + (size_t)y * encoder.rowSize(), encoder.rowSize()));
+      }
+
+      const std::string encoded = stream.str();
+      const auto expected = bmpxx::bmp::encode(pixels, desc);
+      check(std::vector<uint8_t>(encoded.begin(), encoded.end()) == expected, name, "bytes differ from encode()");
+    }
+  }
+
+  // File streams are sized by their last byte instead of having every row written twice
+  void streamEncoderToFileStream(const std::string &name)
+  {
+    const auto path = std::filesystem::temp_directory_path() / "bmpxx_regress_stream.bmp";
+    for (auto order : {bmpxx::RowOrder::TOP_DOWN, bmpxx::RowOrder::BOTTOM_UP})
+    {
+      const bmpxx::BmpDesc desc(13, 7, 3);
+      const auto pixels = makePixels(desc.width, desc.height, desc.channels);
+
+      {
+        std::ofstream stream(path, std::ios::binary);
+        bmpxx::bmp::StreamEncoder encoder(stream, desc, order);
+        for (int32_t row = 0; row < desc.height; row++)
+        {
+          const int32_t y = order == bmpxx::RowOrder::TOP_DOWN ? row : desc.height - 1 - row;
+          encoder.writeRow(std::span<const uint8_t>(pixels.data() + (size_t)y * encoder.rowSize(), encoder.rowSize()));
+        }
+      }
+
+      std::ifstream file(path, std::ios::binary);
+      const std::vector<uint8_t> encoded((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+      check(encoded == bmpxx::bmp::encode(pixels, desc), name, "bytes differ from encode()");
+    }
+    std::filesystem::remove(path);
+  }
+}
+
+int main()
+{
+  run("stream encoder to string stream", streamEncoderToStringStream);
+  run("stream encoder to file stream", streamEncoderToFileStream);
+  run("wrapped image size", wrappedImageSize);
+  run("huge run length encoded image", hugeRleImage);
+  run("run length encoded rows below a region", rleRowsBelowRegion);
+  run("empty encode", emptyEncode);
+  run("oversized encode", oversizedEncode);
+
+  if (failures)
+    return 1;
+
+  std::cout << "All regression tests passed" << std::endl;
+  return 0;
+}
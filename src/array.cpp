@@ -0,0 +1,155 @@
+#include "bmpxx.hpp"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace bmpxx
+{
+  std::vector<ArrayEntry> bmp::indexArray(std::span<const uint8_t> inputArray)
+  {
+    std::vector<ArrayEntry> entries;
+
+    auto add_entry = [&](uint32_t offset, uint16_t display_width, uint16_t display_height)
+    {
+      auto bmp_header = BmpHeader();
+      auto dib_header = DibDecodeHeader();
+      readArrayEntry(inputArray, offset, &bmp_header, &dib_header);
+
+      auto entry = ArrayEntry();
+      entry.display_width = display_width;
+      entry.display_height = display_height;
+
+      if (std::memcmp(bmp_header.identifier, "IC", 2) == 0)
+        entry.type = ArrayImageType::ICON;
+      else if (std::memcmp(bmp_header.identifier, "PT", 2) == 0)
+        entry.type = ArrayImageType::POINTER;
+      else if (std::memcmp(bmp_header.identifier, "CI", 2) == 0 || std::memcmp(bmp_header.identifier, "CP", 2) == 0)
+      {
+        entry.type = bmp_header.identifier[1] == 'I' ? ArrayImageType::COLOR_ICON : ArrayImageType::COLOR_POINTER;
+
+        // The monochrome mask comes first, the file header of the color image follows its palette
+        const uint64_t color_offset = (uint64_t)offset + sizeof(BmpHeader) + dib_header.header_size +
+                                      (uint64_t)dib_header.colors_used * dib_header.meta.palette_entry_size;
+        if (color_offset > UINT32_MAX)
+          throw std::runtime_error("input array entry is out of bounds");
+
+        offset = (uint32_t)color_offset;
+        readArrayEntry(inputArray, offset, &bmp_header, &dib_header);
+      }
+
+      entry.width = dib_header.width;
+      entry.height = dib_header.height;
+      entry.bits_per_pixel = dib_header.bits_per_pixel;
+      entry.offset = offset;
+      entries.push_back(entry);
+    };
+
+    // Anything else is a single image
+    if (inputArray.size() < sizeof(ArrayHeader) || std::memcmp(inputArray.data(), "BA", 2) != 0)
+    {
+      add_entry(0, 0, 0);
+      return entries;
+    }
+
+    uint64_t offset = 0;
+    while (true)
+    {
+      if (inputArray.size() - offset < sizeof(ArrayHeader))
+        throw std::runtime_error("input array entry is out of bounds");
+
+      auto array_header = ArrayHeader();
+      std::memcpy(&array_header, inputArray.data() + offset, sizeof(ArrayHeader));
+
+      if (std::memcmp(array_header.identifier, "BA", 2) != 0)
+        throw std::runtime_error("input array entry is not a bitmap array header");
+
+      add_entry((uint32_t)offset + (uint32_t)sizeof(ArrayHeader), array_header.display_width, array_header.display_height);
+
+      if (array_header.next_offset == 0)
+        break;
+
+      // Entries only ever point forward, which also keeps a broken list from looping
+      if (array_header.next_offset <= offset)
+        throw std::runtime_error("input array next entry offset is invalid");
+
+      offset = array_header.next_offset;
+      if (offset > inputArray.size())
+        throw std::runtime_error("input array entry is out of bounds");
+    }
+
+    return entries;
+  }
+
+  size_t bmp::findArrayEntry(std::span<const ArrayEntry> entries, int32_t width, int32_t height)
+  {
+    if (entries.empty())
+      throw std::invalid_argument("array has no entries");
+
+    size_t best_index = 0;
+    int64_t best_distance = INT64_MAX;
+    for (size_t index = 0; index < entries.size(); index++)
+    {
+      const ArrayEntry &entry = entries[index];
+      const int64_t distance = std::llabs((int64_t)entry.width - width) + std::llabs((int64_t)entry.height - height);
+
+      if (distance < best_distance ||
+          (distance == best_distance && entry.bits_per_pixel > entries[best_index].bits_per_pixel))
+      {
+        best_index = index;
+        best_distance = distance;
+      }
+    }
+
+    return best_index;
+  }
+
+  std::pair<std::vector<uint8_t>, BmpDesc> bmp::decodeArrayEntry(std::span<const uint8_t> inputArray, const ArrayEntry &entry, const DecodeOptions &options)
+  {
+    auto prepared = prepareDecode(inputArray, options, &entry);
+
+    std::vector<uint8_t> decoded_data(prepared.row_size * prepared.description.height);
+    prepared.instrumentation.allocation_ns = prepared.timer.lap();
+
+    decodePixels(prepared.input_image, &prepared.bmp_header, &prepared.dib_header, decoded_data.data(), prepared.row_size, options, nullptr, options.instrument ? &prepared.instrumentation : nullptr);
+
+    if (options.instrument)
+      reportInstrumentation(options.instrument, prepared.instrumentation, prepared.input_image.size(), decoded_data.size());
+
+    return std::make_pair(std::move(decoded_data), prepared.description);
+  }
+
+  std::span<const uint8_t> bmp::readArrayEntry(
+      std::span<const uint8_t> inputArray,
+      uint32_t offset,
+      BmpHeader *bmp_header,
+      DibDecodeHeader *dib_header)
+  {
+    if (offset > inputArray.size() || inputArray.size() - offset <= sizeof(BmpHeader) + sizeof(Dib12Header))
+      throw std::runtime_error("input array entry is out of bounds");
+
+    auto inputImage = inputArray.subspan(offset);
+    std::memcpy(bmp_header, inputImage.data(), sizeof(BmpHeader));
+
+    if (!(
+            std::memcmp(bmp_header->identifier, "BM", 2) == 0 ||
+            std::memcmp(bmp_header->identifier, "CI", 2) == 0 ||
+            std::memcmp(bmp_header->identifier, "CP", 2) == 0 ||
+            std::memcmp(bmp_header->identifier, "IC", 2) == 0 ||
+            std::memcmp(bmp_header->identifier, "PT", 2) == 0))
+      throw std::runtime_error("input array entry is not a BMP image");
+
+    // The file size of an entry is not the size of anything useful, so only the data offset is checked
+    if (bmp_header->data_offset < offset)
+      throw std::runtime_error("input array entry data offset is too small");
+    bmp_header->data_offset -= offset;
+
+    *dib_header = readDIBHeader(inputImage, inputImage.size(), bmp_header);
+
+    return inputImage;
+  }
+}
@@ -0,0 +1,250 @@
+#include "bmpxx.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include <stdexcept>
+
+namespace bmpxx
+{
+  struct bmp::BatchPool
+  {
+    explicit BatchPool(uint32_t threads)
+    {
+      if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+
+      // The calling thread works on every batch too
+      for (uint32_t index = 1; index < threads; index++)
+        workers.emplace_back([this]()
+                             { work(); });
+    }
+
+    ~BatchPool()
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+      }
+      wake.notify_all();
+
+      for (auto &worker : workers)
+        worker.join();
+    }
+
+    // Runs task(0) up to task(task_count - 1) and only returns once every worker is idle again,
+    // so no worker can still be looking at the task afterwards
+    void run(uint32_t count, const std::function<void(uint32_t task)> &function)
+    {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        task = &function;
+        task_count = count;
+        next_task = 0;
+        busy_workers = (uint32_t)workers.size();
+        generation++;
+      }
+      wake.notify_all();
+
+      runTasks(function, count);
+
+      std::unique_lock<std::mutex> lock(mutex);
+      idle.wait(lock, [this]()
+                { return busy_workers == 0; });
+      task = nullptr;
+    }
+
+    // Gives back a recycled buffer, or an empty one when there is none
+    std::vector<uint8_t> takeBuffer()
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (free_buffers.empty())
+        return std::vector<uint8_t>();
+
+      auto buffer = std::move(free_buffers.back());
+      free_buffers.pop_back();
+      return buffer;
+    }
+
+    void giveBuffer(std::vector<uint8_t> &&buffer)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      free_buffers.push_back(std::move(buffer));
+    }
+
+    // Decoded mask tables only depend on the masks, entries are never removed so the reference stays valid
+    const DecodedRgbaMasks &cachedMasks(DibDecodeHeader *dib_header)
+    {
+      // Copied out first, packed fields can not be bound to references
+      const uint32_t red_mask = dib_header->masks_rgba.red_mask;
+      const uint32_t green_mask = dib_header->masks_rgba.green_mask;
+      const uint32_t blue_mask = dib_header->masks_rgba.blue_mask;
+      const uint32_t alpha_mask = dib_header->masks_rgba.alpha_mask;
+      const auto key = std::make_tuple(red_mask, green_mask, blue_mask, alpha_mask);
+
+      std::lock_guard<std::mutex> lock(masks_mutex);
+      auto found = masks_cache.find(key);
+      if (found == masks_cache.end())
+        found = masks_cache.emplace(key, decodeMasks(dib_header)).first;
+      return found->second;
+    }
+
+  private:
+    void work()
+    {
+      uint64_t seen_generation = 0;
+
+      while (true)
+      {
+        const std::function<void(uint32_t task)> *function;
+        uint32_t count;
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          wake.wait(lock, [&]()
+                    { return stopping || generation != seen_generation; });
+          if (stopping)
+            return;
+
+          seen_generation = generation;
+          function = task;
+          count = task_count;
+        }
+
+        runTasks(*function, count);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--busy_workers == 0)
+          idle.notify_one();
+      }
+    }
+
+    void runTasks(const std::function<void(uint32_t task)> &function, uint32_t count)
+    {
+      for (uint32_t index = next_task++; index < count; index = next_task++)
+        function(index);
+    }
+
+    std::vector<std::thread> workers;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    const std::function<void(uint32_t task)> *task = nullptr;
+    uint32_t task_count = 0;
+    std::atomic<uint32_t> next_task = 0;
+    uint32_t busy_workers = 0;
+    uint64_t generation = 0;
+    bool stopping = false;
+
+    std::vector<std::vector<uint8_t>> free_buffers;
+
+    std::mutex masks_mutex;
+    std::map<std::tuple<uint32_t, uint32_t, uint32_t, uint32_t>, DecodedRgbaMasks> masks_cache;
+  };
+
+  bmp::BatchDecoder::BatchDecoder(uint32_t threads, const DecodeOptions &options)
+      : options(options), pool(std::make_unique<BatchPool>(threads))
+  {
+    // The images are spread over the threads instead of their rows
+    this->options.parallel = ParallelOptions();
+  }
+
+  bmp::BatchDecoder::~BatchDecoder() = default;
+
+  std::vector<std::pair<std::vector<uint8_t>, BmpDesc>> bmp::BatchDecoder::decode(std::span<const std::span<const uint8_t>> inputs)
+  {
+    std::vector<std::pair<std::vector<uint8_t>, BmpDesc>> results(inputs.size());
+    std::vector<std::exception_ptr> errors(inputs.size());
+
+    pool->run((uint32_t)inputs.size(), [&](uint32_t index)
+    {
+      try
+      {
+        auto prepared = prepareDecode(inputs[index], options);
+
+        auto decoded_data = pool->takeBuffer();
+        decoded_data.resize(prepared.row_size * prepared.description.height);
+        prepared.instrumentation.allocation_ns = prepared.timer.lap();
+
+        // Palette and run length encoded images have no masks to decode
+        const DecodedRgbaMasks *masks = nullptr;
+        if (prepared.dib_header.bits_per_pixel > 8)
+          masks = &pool->cachedMasks(&prepared.dib_header);
+
+        decodePixels(prepared.input_image, &prepared.bmp_header, &prepared.dib_header, decoded_data.data(), prepared.row_size, options, masks, options.instrument ? &prepared.instrumentation : nullptr);
+
+        if (options.instrument)
+          reportInstrumentation(options.instrument, prepared.instrumentation, prepared.input_image.size(), decoded_data.size());
+
+        results[index] = std::make_pair(std::move(decoded_data), prepared.description);
+      }
+      catch (...)
+      {
+        errors[index] = std::current_exception();
+      }
+    });
+
+    for (const auto &error : errors)
+      if (error)
+        std::rethrow_exception(error);
+
+    return results;
+  }
+
+  void bmp::BatchDecoder::recycle(std::vector<uint8_t> &&buffer)
+  {
+    pool->giveBuffer(std::move(buffer));
+  }
+
+  bmp::BatchEncoder::BatchEncoder(uint32_t threads, const EncodeOptions &options)
+      : options(options), pool(std::make_unique<BatchPool>(threads))
+  {
+    // The images are spread over the threads instead of their rows
+    this->options.parallel = ParallelOptions();
+  }
+
+  bmp::BatchEncoder::~BatchEncoder() = default;
+
+  std::vector<std::vector<uint8_t>> bmp::BatchEncoder::encode(std::span<const std::pair<std::span<const uint8_t>, BmpDesc>> inputs)
+  {
+    std::vector<std::vector<uint8_t>> results(inputs.size());
+    std::vector<std::exception_ptr> errors(inputs.size());
+
+    pool->run((uint32_t)inputs.size(), [&](uint32_t index)
+    {
+      try
+      {
+        auto encoded_data = pool->takeBuffer();
+        encodeTo(inputs[index].first, inputs[index].second, options, [&](size_t size)
+        {
+          encoded_data.resize(size);
+          return encoded_data.data();
+        });
+        results[index] = std::move(encoded_data);
+      }
+      catch (...)
+      {
+        errors[index] = std::current_exception();
+      }
+    });
+
+    for (const auto &error : errors)
+      if (error)
+        std::rethrow_exception(error);
+
+    return results;
+  }
+
+  void bmp::BatchEncoder::recycle(std::vector<uint8_t> &&buffer)
+  {
+    pool->giveBuffer(std::move(buffer));
+  }
+}
@@ -1,36 +1,195 @@
 #include "bmpxx.hpp"
 
+#include <algorithm>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <span>
 #include <vector>
 #include <stdexcept>
+#include <utility>
 #include <bit>
 
 namespace bmpxx
 {
-  std::pair<std::vector<uint8_t>, BmpDesc> bmp::decode(std::vector<uint8_t> inputImage)
+  std::pair<std::vector<uint8_t>, BmpDesc> bmp::decode(const std::vector<uint8_t> &inputImage, const DecodeOptions &options)
   {
-    auto bmp_header = readBMPHeader(inputImage);
+    return decode(std::span<const uint8_t>(inputImage), options);
+  }
+
+  std::pair<std::vector<uint8_t>, BmpDesc> bmp::decode(std::span<const uint8_t> inputImage, const DecodeOptions &options)
+  {
+    auto prepared = prepareDecode(inputImage, options);
+
+    std::vector<uint8_t> decoded_data(prepared.row_size * prepared.description.height);
+    prepared.instrumentation.allocation_ns = prepared.timer.lap();
+
+    decodePixels(prepared.input_image, &prepared.bmp_header, &prepared.dib_header, decoded_data.data(), prepared.row_size, options, nullptr, options.instrument ? &prepared.instrumentation : nullptr);
+
+    if (options.instrument)
+      reportInstrumentation(options.instrument, prepared.instrumentation, prepared.input_image.size(), decoded_data.size());
+
+    return std::make_pair(std::move(decoded_data), prepared.description);
+  }
+
+  std::pair<Buffer, BmpDesc> bmp::decode(std::span<const uint8_t> inputImage, std::pmr::memory_resource *memory_resource, const DecodeOptions &options)
+  {
+    auto prepared = prepareDecode(inputImage, options);
+
+    // Every byte is written by decodePixels, so nothing has to be cleared
+    Buffer decoded_data(prepared.row_size * prepared.description.height, memory_resource);
+    prepared.instrumentation.allocation_ns = prepared.timer.lap();
+
+    decodePixels(prepared.input_image, &prepared.bmp_header, &prepared.dib_header, decoded_data.data(), prepared.row_size, options, nullptr, options.instrument ? &prepared.instrumentation : nullptr);
+
+    if (options.instrument)
+      reportInstrumentation(options.instrument, prepared.instrumentation, prepared.input_image.size(), decoded_data.size());
+
+    return std::make_pair(std::move(decoded_data), prepared.description);
+  }
+
+  std::pair<BmpDesc, size_t> bmp::probe(std::span<const uint8_t> inputImage, const DecodeOptions &options)
+  {
+    const auto prepared = prepareDecode(inputImage, options);
+
+    return std::make_pair(prepared.description, prepared.row_size * prepared.description.height);
+  }
+
+  BmpView bmp::view(std::span<const uint8_t> inputImage)
+  {
+    auto bmp_header = readBMPHeader(inputImage, inputImage.size());
+
+    auto dib_header = readDIBHeader(inputImage, inputImage.size(), &bmp_header);
+
+    // Also rejects unsupported bit depths
+    describeImage(&dib_header, PixelFormat::NATIVE);
+
+    if (dib_header.compression == BI_RLE8 || dib_header.compression == BI_RLE4)
+      throw std::runtime_error("input image compression has no raw rows");
+
+    auto image_view = BmpView();
+    image_view.width = dib_header.width;
+    image_view.height = dib_header.height;
+    image_view.bits_per_pixel = dib_header.bits_per_pixel;
+
+    // Nothing is copied, so every row the view points to has to be inside the input
+    if ((uint64_t)dib_header.meta.padded_row_width * dib_header.height > inputImage.size() - bmp_header.data_offset)
+      throw std::runtime_error("input image is too small");
+
+    image_view.stride = dib_header.meta.padded_row_width;
+    image_view.pixels = inputImage.data() + bmp_header.data_offset;
+    image_view.row_step = image_view.stride;
+
+    // Bmp rows are stored bottom up, unless the height was negative
+    if (!dib_header.meta.is_top_down)
+    {
+      image_view.pixels += (size_t)(dib_header.height - 1) * image_view.stride;
+      image_view.row_step = -image_view.row_step;
+    }
+
+    image_view.red_mask = dib_header.masks_rgba.red_mask;
+    image_view.green_mask = dib_header.masks_rgba.green_mask;
+    image_view.blue_mask = dib_header.masks_rgba.blue_mask;
+    image_view.alpha_mask = dib_header.masks_rgba.alpha_mask;
+
+    if (dib_header.meta.has_canonical_masks)
+    {
+      if (dib_header.bits_per_pixel == 24)
+        image_view.channel_order = ChannelOrder::BGR;
+      else if (dib_header.meta.has_alpha_channel)
+        image_view.channel_order = ChannelOrder::BGRA;
+      else
+        image_view.channel_order = ChannelOrder::BGRX;
+    }
+
+    if (dib_header.bits_per_pixel <= 8)
+    {
+      image_view.palette = inputImage.data() + sizeof(BmpHeader) + dib_header.header_size;
+      image_view.palette_size = dib_header.colors_used;
+      image_view.palette_entry_size = dib_header.meta.palette_entry_size;
+    }
+
+    return image_view;
+  }
+
+  BmpDesc bmp::decodeInto(std::span<const uint8_t> inputImage, std::span<uint8_t> output, size_t stride, const DecodeOptions &options)
+  {
+    auto prepared = prepareDecode(inputImage, options);
+    const size_t row_size = prepared.row_size;
+    const int32_t height = prepared.description.height;
+
+    // A stride of 0 means the rows are tightly packed
+    if (stride == 0)
+      stride = row_size;
+
+    if (stride < row_size)
+      throw std::invalid_argument("output stride is smaller than a decoded row");
+
+    if (output.size() < stride * (height - 1) + row_size)
+      throw std::invalid_argument("output buffer is too small for the decoded image");
+
+    decodePixels(prepared.input_image, &prepared.bmp_header, &prepared.dib_header, output.data(), stride, options, nullptr, options.instrument ? &prepared.instrumentation : nullptr);
+
+    if (options.instrument)
+      reportInstrumentation(options.instrument, prepared.instrumentation, prepared.input_image.size(), row_size * height);
+
+    return prepared.description;
+  }
 
-    auto dib_header = readDIBHeader(inputImage, &bmp_header);
+  bmp::PreparedDecode bmp::prepareDecode(std::span<const uint8_t> inputImage, const DecodeOptions &options, const ArrayEntry *entry)
+  {
+    PreparedDecode prepared;
+    prepared.timer = StageTimer(options.instrument != nullptr);
 
-    switch (dib_header.bits_per_pixel)
+    if (entry)
+      prepared.input_image = readArrayEntry(inputImage, entry->offset, &prepared.bmp_header, &prepared.dib_header);
+    else
+    {
+      prepared.input_image = inputImage;
+      prepared.bmp_header = readBMPHeader(inputImage, inputImage.size());
+      prepared.dib_header = readDIBHeader(inputImage, inputImage.size(), &prepared.bmp_header);
+    }
+
+    prepared.description = describeImage(&prepared.dib_header, options.format, options.region, options.downscale, options.max_pixels);
+    prepared.row_size = (size_t)prepared.description.width * prepared.description.channels * prepared.description.bit_depth / 8;
+    prepared.instrumentation.header_ns = prepared.timer.lap();
+
+    return prepared;
+  }
+
+  BmpDesc bmp::describeImage(DibDecodeHeader *dib_header, PixelFormat format, const Region &region, uint32_t downscale, uint64_t max_pixels)
+  {
+    if (downscale != 1 && downscale != 2 && downscale != 4 && downscale != 8)
+      throw std::invalid_argument("downscale has to be 1, 2, 4 or 8");
+
+    switch (dib_header->bits_per_pixel)
     {
     case 1:
     case 2:
     case 4:
     case 8:
-    {
-      return decodePalette(inputImage, &bmp_header, &dib_header);
-      break;
-    }
-
     case 16:
     case 24:
     case 32:
     {
-      return decodeNormal(inputImage, &bmp_header, &dib_header);
-      break;
+      const PixelFormat resolved_format = resolvePixelFormat(dib_header, format);
+      const bool is_wide = isWideFormat(resolved_format);
+      if (is_wide && downscale != 1)
+        throw std::invalid_argument("downscale is only supported for 8 bit formats");
+
+      const Region decoded_region = resolveRegion(dib_header, region);
+      if ((uint64_t)decoded_region.width * (uint64_t)decoded_region.height > max_pixels)
+        throw std::runtime_error("input image has more pixels than allowed");
+
+      // A run length encoded region still goes through whole stored rows
+      if ((dib_header->compression == BI_RLE8 || dib_header->compression == BI_RLE4) && (uint64_t)dib_header->width > max_pixels)
+        throw std::runtime_error("input image has more pixels than allowed");
+
+      return BmpDesc(
+          (decoded_region.width + downscale - 1) / downscale,
+          (decoded_region.height + downscale - 1) / downscale,
+          pixelFormatChannels(resolved_format),
+          is_wide ? 16 : 8);
     }
 
     default:
@@ -40,93 +199,926 @@ namespace bmpxx
     }
   }
 
-  std::pair<std::vector<uint8_t>, BmpDesc> bmp::decodePalette(
-      std::vector<uint8_t> inputImage,
+  Region bmp::resolveRegion(DibDecodeHeader *dib_header, const Region &region)
+  {
+    if (region.x == 0 && region.y == 0 && region.width == 0 && region.height == 0)
+    {
+      auto whole_image = Region();
+      whole_image.width = dib_header->width;
+      whole_image.height = dib_header->height;
+      return whole_image;
+    }
+
+    if (region.x < 0 || region.y < 0 || region.width <= 0 || region.height <= 0 ||
+        (int64_t)region.x + region.width > dib_header->width ||
+        (int64_t)region.y + region.height > dib_header->height)
+      throw std::invalid_argument("decode region is outside the image");
+
+    return region;
+  }
+
+  PixelFormat bmp::resolvePixelFormat(DibDecodeHeader *dib_header, PixelFormat format)
+  {
+    if (format != PixelFormat::NATIVE)
+      return format;
+
+    // A palette image is always RGB
+    if (dib_header->bits_per_pixel > 8 && dib_header->meta.has_alpha_channel)
+      return PixelFormat::RGBA8;
+
+    return PixelFormat::RGB8;
+  }
+
+  uint8_t bmp::pixelFormatChannels(PixelFormat format)
+  {
+    switch (format)
+    {
+    case PixelFormat::RGB8:
+    case PixelFormat::RGB16:
+      return 3;
+    case PixelFormat::GRAY8:
+      return 1;
+    case PixelFormat::RGBA8:
+    case PixelFormat::BGRA8:
+    case PixelFormat::RGBA8_PREMULTIPLIED:
+    case PixelFormat::RGBA16:
+      return 4;
+    default:
+      throw std::invalid_argument("pixel format is invalid");
+    }
+  }
+
+  bool bmp::isWideFormat(PixelFormat format)
+  {
+    return format == PixelFormat::RGB16 || format == PixelFormat::RGBA16;
+  }
+
+  PixelFormat bmp::narrowFormat(PixelFormat format)
+  {
+    switch (format)
+    {
+    case PixelFormat::RGB16:
+      return PixelFormat::RGB8;
+    case PixelFormat::RGBA16:
+      return PixelFormat::RGBA8;
+    default:
+      return format;
+    }
+  }
+
+  void bmp::decodePixels(
+      std::span<const uint8_t> inputImage,
       BmpHeader *bmp_header,
-      DibDecodeHeader *dib_header)
+      DibDecodeHeader *dib_header,
+      uint8_t *output,
+      size_t output_stride,
+      const DecodeOptions &options,
+      const DecodedRgbaMasks *masks,
+      Instrumentation *instrumentation)
   {
-    if (dib_header->colors_used == 0 || dib_header->colors_used > 256)
-      throw std::runtime_error("input image colors used is invalid");
+    StageTimer timer(instrumentation != nullptr);
+    const PixelFormat format = resolvePixelFormat(dib_header, options.format);
+    const Region region = resolveRegion(dib_header, options.region);
 
-    // Check if the data_offset is actually a valid position in the file
-    if (bmp_header->data_offset < sizeof(BmpHeader) + dib_header->header_size + dib_header->colors_used * 4)
-      throw std::runtime_error("input image data offset is too small");
+    // Run length encoded rows can only be found by walking all data before them
+    if (dib_header->compression == BI_RLE8 || dib_header->compression == BI_RLE4)
+    {
+      decodeRle(inputImage, bmp_header, dib_header, narrowFormat(format), region, options.downscale, output, output_stride);
+
+      // A palette has 8 bit colors, so nothing is lost by widening afterwards
+      if (isWideFormat(format))
+        for (int32_t y = 0; y < region.height; y++)
+          widenRow(output + (size_t)y * output_stride, (size_t)region.width * pixelFormatChannels(format));
 
-    // Extract pointer to palette
-    const uint32_t *palette = reinterpret_cast<const uint32_t *>(inputImage.data() + sizeof(BmpHeader) + dib_header->header_size);
+      if (instrumentation)
+      {
+        instrumentation->row_ns = timer.lap();
+        instrumentation->row_path = "rle";
+      }
+      return;
+    }
 
-    const uint32_t pixels_per_byte = (8 / dib_header->bits_per_pixel);
-    const uint32_t pixels_mask = ((1 << dib_header->bits_per_pixel) - 1);
+    RowDecoder row_decoder;
+    prepareRowDecoder(inputImage, dib_header, format, &row_decoder, masks);
+    const uint64_t table_ns = timer.lap();
 
-    // A palette image is always 3 channel RGB
-    uint32_t decoded_data_pos = 0;
-    auto description = BmpDesc(dib_header->width, dib_header->height, 3);
-    std::vector<uint8_t> decoded_data(description.width * description.height * description.channels);
+    // Stored rows are directly addressable, so only the region is ever read
+    const uint64_t first_bit = (uint64_t)region.x * dib_header->bits_per_pixel;
+    row_decoder.width = region.width;
+    row_decoder.first_byte = first_bit / 8;
+    row_decoder.skipped_pixels = (uint32_t)(first_bit % 8) / dib_header->bits_per_pixel;
 
-    for (int32_t y = dib_header->height - 1; y >= 0; y--)
+    // Rows are addressed from the top row with a signed step, bottom up files step backwards
+    const bool is_top_down = dib_header->meta.is_top_down;
+    const std::ptrdiff_t row_step = is_top_down
+                                        ? (std::ptrdiff_t)dib_header->meta.padded_row_width
+                                        : -(std::ptrdiff_t)dib_header->meta.padded_row_width;
+    const uint8_t *top_row_ptr = inputImage.data() + bmp_header->data_offset;
+    if (!is_top_down)
+      top_row_ptr += (size_t)(dib_header->height - 1) * dib_header->meta.padded_row_width;
+
+    // Downscaled images are split in bands of output rows, every one decoding its own source rows
+    const int32_t downscale = (int32_t)options.downscale;
+    const int32_t output_height = (region.height + downscale - 1) / downscale;
+
+    const uint32_t bands = runRowBands(options.parallel, output_height, region.width, [&](int32_t first_row, int32_t end_row)
     {
-      const uint8_t *row_ptr = reinterpret_cast<const uint8_t *>(inputImage.data() + bmp_header->data_offset + y * dib_header->meta.padded_row_width);
-      for (int32_t x = 0; x < dib_header->width; x++)
+      if (downscale == 1)
       {
-        const uint32_t target_byte = x / pixels_per_byte;
-        const uint32_t target_bit = x % pixels_per_byte;
+        // Walks the file front to back, so a mapped file is read sequentially
+        for (int32_t i = 0; i < end_row - first_row; i++)
+        {
+          const int32_t y = is_top_down ? first_row + i : end_row - 1 - i;
+          decodeRow(row_decoder, top_row_ptr + (region.y + y) * row_step, output + (size_t)y * output_stride);
+        }
+        return;
+      }
 
-        const uint32_t target_shift = 8 - ((target_bit + 1) * dib_header->bits_per_pixel);
+      RowDownscaler downscaler(region.width, row_decoder.channels, options.downscale);
+      for (int32_t i = 0; i < end_row - first_row; i++)
+      {
+        const int32_t y = is_top_down ? first_row + i : end_row - 1 - i;
+        const int32_t first_source_row = y * downscale;
+        const int32_t source_rows = std::min(downscale, region.height - first_source_row);
+        for (int32_t j = 0; j < source_rows; j++)
+        {
+          const int32_t source_y = first_source_row + (is_top_down ? j : source_rows - 1 - j);
+          decodeRow(row_decoder, top_row_ptr + (region.y + source_y) * row_step, downscaler.row.data());
+          downscaler.addRow(downscaler.row.data());
+        }
+        downscaler.flush(output + (size_t)y * output_stride);
+      }
+    });
 
-        const uint32_t palette_index = (row_ptr[target_byte] >> target_shift) & pixels_mask;
+    if (instrumentation)
+    {
+      instrumentation->table_ns = table_ns;
+      instrumentation->row_ns = timer.lap();
+      instrumentation->row_path = row_decoder.row_path;
+      instrumentation->kernel = row_decoder.kernel;
+      instrumentation->threads = bands;
+    }
+  }
 
-        const RgbaColor *color = reinterpret_cast<const RgbaColor *>(palette + palette_index);
+  void bmp::prepareRowDecoder(
+      std::span<const uint8_t> inputImage,
+      DibDecodeHeader *dib_header,
+      PixelFormat format,
+      RowDecoder *row_decoder,
+      const DecodedRgbaMasks *masks)
+  {
+    row_decoder->bits_per_pixel = dib_header->bits_per_pixel;
+    row_decoder->width = dib_header->width;
 
-        decoded_data[decoded_data_pos++] = color->red;
-        decoded_data[decoded_data_pos++] = color->green;
-        decoded_data[decoded_data_pos++] = color->blue;
+    if (isWideFormat(format))
+    {
+      if (dib_header->bits_per_pixel > 8 && !dib_header->meta.has_canonical_masks)
+      {
+        prepareWideRowDecoder(dib_header, format, row_decoder);
+        return;
       }
+
+      // Palettes and 8 bit BGR(A) lose nothing when decoded at 8 bits
+      row_decoder->widen = true;
+      format = narrowFormat(format);
+    }
+
+    row_decoder->channels = pixelFormatChannels(format);
+
+    if (dib_header->bits_per_pixel <= 8)
+    {
+      uint8_t colors[256 * 4];
+      fillPaletteColors(inputImage, dib_header, format, colors);
+      fillPaletteByteTable(dib_header->bits_per_pixel, row_decoder->channels, colors, row_decoder->byte_table);
+      row_decoder->pixel_row = selectPaletteRow(dib_header->bits_per_pixel, row_decoder->channels);
+      row_decoder->row_path = "palette";
+      return;
+    }
+
+    row_decoder->masks = masks ? *masks : decodeMasks(dib_header);
+
+    const uint32_t bytes_per_pixel = dib_header->bits_per_pixel / 8;
+    const bool has_alpha_channel = dib_header->meta.has_alpha_channel;
+    const bool has_canonical_masks = dib_header->meta.has_canonical_masks;
+
+    switch (format)
+    {
+    case PixelFormat::RGB8:
+      row_decoder->pixel_row = selectPixelRow<PixelFormat::RGB8>(bytes_per_pixel, has_alpha_channel, has_canonical_masks);
+      break;
+    case PixelFormat::RGBA8:
+      row_decoder->pixel_row = selectPixelRow<PixelFormat::RGBA8>(bytes_per_pixel, has_alpha_channel, has_canonical_masks);
+      break;
+    case PixelFormat::BGRA8:
+      row_decoder->pixel_row = selectPixelRow<PixelFormat::BGRA8>(bytes_per_pixel, has_alpha_channel, has_canonical_masks);
+      break;
+    case PixelFormat::RGBA8_PREMULTIPLIED:
+      row_decoder->pixel_row = selectPixelRow<PixelFormat::RGBA8_PREMULTIPLIED>(bytes_per_pixel, has_alpha_channel, has_canonical_masks);
+      break;
+    default:
+      row_decoder->pixel_row = selectPixelRow<PixelFormat::GRAY8>(bytes_per_pixel, has_alpha_channel, has_canonical_masks);
+      break;
+    }
+
+    // The vector kernels only produce RGB and RGBA
+    const auto &kernels = selectRowKernels();
+    row_decoder->row_path = has_canonical_masks ? "canonical" : "masked";
+    if (has_canonical_masks)
+    {
+      if (format == PixelFormat::RGB8)
+        row_decoder->vector_row = bytes_per_pixel == 3 ? kernels.swizzle_3_to_3 : kernels.swizzle_4_to_3;
+      else if (format == PixelFormat::RGBA8 && has_alpha_channel)
+        row_decoder->vector_row = kernels.swizzle_4_to_4;
+
+      if (row_decoder->vector_row)
+        row_decoder->kernel = kernels.swizzle_isa;
+    }
+    else if (format == PixelFormat::RGB8 && bytes_per_pixel == 2 && !has_alpha_channel && dib_header->masks_rgba.blue_mask == 0x001f)
+    {
+      // RGB565 and RGB555 have their own vector kernels, the tail goes through the tables
+      if (dib_header->masks_rgba.red_mask == 0xf800 && dib_header->masks_rgba.green_mask == 0x07e0)
+        row_decoder->vector_row = kernels.unpack_565;
+      else if (dib_header->masks_rgba.red_mask == 0x7c00 && dib_header->masks_rgba.green_mask == 0x03e0)
+        row_decoder->vector_row = kernels.unpack_555;
+
+      if (row_decoder->vector_row)
+        row_decoder->kernel = kernels.unpack_isa;
     }
+  }
+
+  void bmp::prepareWideRowDecoder(DibDecodeHeader *dib_header, PixelFormat format, RowDecoder *row_decoder)
+  {
+    const uint32_t bytes_per_pixel = dib_header->bits_per_pixel / 8;
+    const bool has_alpha_channel = dib_header->meta.has_alpha_channel;
+    const bool has_output_alpha = format == PixelFormat::RGBA16;
+
+    row_decoder->channels = pixelFormatChannels(format) * 2;
+    row_decoder->wide_masks = decodeWideMasks(dib_header);
+    row_decoder->row_path = "masked";
+
+    switch (bytes_per_pixel | (has_output_alpha ? 0x10 : 0) | (has_alpha_channel ? 0x20 : 0))
+    {
+    case 0x02:
+    case 0x22:
+      row_decoder->pixel_row = decodeWideRow<2, 3, false>;
+      break;
+    case 0x03:
+    case 0x23:
+      row_decoder->pixel_row = decodeWideRow<3, 3, false>;
+      break;
+    case 0x04:
+    case 0x24:
+      row_decoder->pixel_row = decodeWideRow<4, 3, false>;
+      break;
+    case 0x12:
+      row_decoder->pixel_row = decodeWideRow<2, 4, false>;
+      break;
+    case 0x13:
+      row_decoder->pixel_row = decodeWideRow<3, 4, false>;
+      break;
+    case 0x14:
+      row_decoder->pixel_row = decodeWideRow<4, 4, false>;
+      break;
+    case 0x32:
+      row_decoder->pixel_row = decodeWideRow<2, 4, true>;
+      break;
+    case 0x33:
+      row_decoder->pixel_row = decodeWideRow<3, 4, true>;
+      break;
+    default:
+      row_decoder->pixel_row = decodeWideRow<4, 4, true>;
+      break;
+    }
+
+    // 10:10:10:2 has its own vector kernels, the tail goes through the masks
+    if (bytes_per_pixel == 4 &&
+        dib_header->masks_rgba.red_mask == 0x3ff00000 &&
+        dib_header->masks_rgba.green_mask == 0x000ffc00 &&
+        dib_header->masks_rgba.blue_mask == 0x000003ff &&
+        (dib_header->masks_rgba.alpha_mask == 0 || dib_header->masks_rgba.alpha_mask == 0xc0000000))
+    {
+      const auto &kernels = selectRowKernels();
+      if (!has_output_alpha)
+        row_decoder->vector_row = kernels.unpack_1010102_to_3;
+      else if (has_alpha_channel)
+        row_decoder->vector_row = kernels.unpack_1010102_to_4;
+      else
+        row_decoder->vector_row = kernels.unpack_1010102_to_4_opaque;
+      row_decoder->kernel = kernels.unpack_isa;
+    }
+  }
+
+  void bmp::decodeRow(const RowDecoder &row_decoder, const uint8_t *row_ptr, uint8_t *output_ptr)
+  {
+    uint8_t *const row_output_ptr = output_ptr;
+    row_ptr += row_decoder.first_byte;
+    int32_t width = row_decoder.width;
+
+    // A region can start inside a palette byte, the whole byte is decoded and the pixels before it dropped
+    if (row_decoder.skipped_pixels)
+    {
+      const int32_t pixels_per_byte = 8 / row_decoder.bits_per_pixel;
+      const int32_t lead_pixels = std::min<int32_t>(pixels_per_byte - (int32_t)row_decoder.skipped_pixels, width);
+      uint8_t lead[8 * 4];
+      row_decoder.pixel_row(row_ptr, lead, pixels_per_byte, row_decoder);
+      std::memcpy(output_ptr, lead + row_decoder.skipped_pixels * row_decoder.channels, (size_t)lead_pixels * row_decoder.channels);
+
+      row_ptr++;
+      output_ptr += lead_pixels * row_decoder.channels;
+      width -= lead_pixels;
+    }
+
+    if (width > 0)
+    {
+      // The vector kernel does the bulk of the row, the scalar code the rest
+      int32_t done = 0;
+      if (row_decoder.vector_row)
+        done = row_decoder.vector_row(row_ptr, output_ptr, width);
+
+      row_decoder.pixel_row(
+          row_ptr + done * (row_decoder.bits_per_pixel / 8),
+          output_ptr + done * row_decoder.channels,
+          width - done,
+          row_decoder);
+    }
+
+    if (row_decoder.widen)
+      widenRow(row_output_ptr, (size_t)row_decoder.width * row_decoder.channels);
+  }
+
+  bmp::PixelRow bmp::selectPaletteRow(uint32_t bits_per_pixel, uint8_t channels)
+  {
+    switch ((bits_per_pixel << 4) | channels)
+    {
+    case 0x11:
+      return decodePaletteRow<1, 1>;
+    case 0x13:
+      return decodePaletteRow<1, 3>;
+    case 0x14:
+      return decodePaletteRow<1, 4>;
+    case 0x21:
+      return decodePaletteRow<2, 1>;
+    case 0x23:
+      return decodePaletteRow<2, 3>;
+    case 0x24:
+      return decodePaletteRow<2, 4>;
+    case 0x41:
+      return decodePaletteRow<4, 1>;
+    case 0x43:
+      return decodePaletteRow<4, 3>;
+    case 0x44:
+      return decodePaletteRow<4, 4>;
+    case 0x81:
+      return decodePaletteRow<8, 1>;
+    case 0x83:
+      return decodePaletteRow<8, 3>;
+    default:
+      return decodePaletteRow<8, 4>;
+    }
+  }
+
+  template <uint32_t BitsPerPixel, uint8_t Channels>
+  void bmp::decodePaletteRow(const uint8_t *row_ptr, uint8_t *output_ptr, int32_t width, const RowDecoder &row_decoder)
+  {
+    constexpr uint32_t pixels_per_byte = 8 / BitsPerPixel;
+    constexpr uint32_t entry_size = pixels_per_byte * Channels;
+    const uint8_t *byte_table = row_decoder.byte_table;
+
+    if constexpr (BitsPerPixel == 8 && Channels == 3)
+    {
+      // The last pixel is read on its own, so an empty row must not get there
+      if (width <= 0)
+        return;
+
+      // A 4 byte copy is a single store, the extra byte is overwritten by the next pixel
+      for (int32_t i = 0; i < width - 1; i++)
+      {
+        std::memcpy(output_ptr, byte_table + row_ptr[i] * 3, 4);
+        output_ptr += 3;
+      }
+      std::memcpy(output_ptr, byte_table + row_ptr[width - 1] * 3, 3);
+      return;
+    }
+
+    // Whole source bytes are a single fixed size copy each
+    const int32_t full_bytes = width / (int32_t)pixels_per_byte;
+    for (int32_t i = 0; i < full_bytes; i++)
+    {
+      std::memcpy(output_ptr, byte_table + row_ptr[i] * entry_size, entry_size);
+      output_ptr += entry_size;
+    }
+
+    // The last byte can be partially used
+    const uint32_t remaining_pixels = (uint32_t)width % pixels_per_byte;
+    if (remaining_pixels)
+      std::memcpy(output_ptr, byte_table + row_ptr[full_bytes] * entry_size, remaining_pixels * Channels);
+  }
+
+  void bmp::fillPaletteColors(std::span<const uint8_t> inputImage, DibDecodeHeader *dib_header, PixelFormat format, uint8_t *colors)
+  {
+    const uint8_t channels = pixelFormatChannels(format);
+
+    // Every index gets a color, indices past the palette become black instead of reading past it
+    const uint8_t *palette = inputImage.data() + sizeof(BmpHeader) + dib_header->header_size;
+    const uint8_t entry_size = dib_header->meta.palette_entry_size;
+    for (uint32_t i = 0; i < 256; i++)
+    {
+      // Entries are stored blue, green, red
+      const uint8_t *entry = palette + i * entry_size;
+      if (i < dib_header->colors_used)
+        storePixel(format, colors + i * channels, entry[2], entry[1], entry[0], 255);
+      else
+        storePixel(format, colors + i * channels, 0, 0, 0, 255);
+    }
+  }
+
+  void bmp::fillPaletteByteTable(uint32_t bits_per_pixel, uint8_t channels, const uint8_t *colors, uint8_t *byte_table)
+  {
+    const uint32_t pixels_per_byte = 8 / bits_per_pixel;
+    const uint32_t pixels_mask = (1 << bits_per_pixel) - 1;
 
-    return std::make_pair(decoded_data, description);
+    // The first pixel is stored in the most significant bits,
+    // every entry is a fixed 4 byte copy whose extra bytes are overwritten by the next entry
+    for (uint32_t byte = 0; byte < 256; byte++)
+    {
+      for (uint32_t pixel = 0; pixel < pixels_per_byte; pixel++)
+      {
+        const uint32_t shift = 8 - (pixel + 1) * bits_per_pixel;
+        const uint32_t palette_index = (byte >> shift) & pixels_mask;
+        std::memcpy(byte_table + (byte * pixels_per_byte + pixel) * channels, colors + palette_index * channels, 4);
+      }
+    }
   }
 
-  std::pair<std::vector<uint8_t>, BmpDesc> bmp::decodeNormal(
-      std::vector<uint8_t> inputImage,
+  void bmp::decodeRle(
+      std::span<const uint8_t> inputImage,
       BmpHeader *bmp_header,
-      DibDecodeHeader *dib_header)
+      DibDecodeHeader *dib_header,
+      PixelFormat format,
+      const Region &region,
+      uint32_t downscale,
+      uint8_t *output,
+      size_t output_stride)
   {
-    uint32_t decoded_data_pos = 0;
-    auto description = BmpDesc(
-        dib_header->width,
-        dib_header->height,
-        dib_header->meta.has_alpha_channel ? 4 : 3);
-    std::vector<uint8_t> decoded_data(description.width * description.height * description.channels);
+    const uint8_t channels = pixelFormatChannels(format);
+    uint8_t colors[256 * 4];
+    fillPaletteColors(inputImage, dib_header, format, colors);
 
-    auto masks = decodeMasks(dib_header);
-    // Should be divisible by 8 if reached here, not gonna check for speed
-    uint32_t bytes_per_pixel = dib_header->bits_per_pixel / 8;
+    const uint8_t *data = inputImage.data() + bmp_header->data_offset;
+    const uint32_t data_size = dib_header->data_size;
+    uint32_t pos = 0;
+
+    const bool is_rle4 = dib_header->compression == BI_RLE4;
+    const int32_t width = dib_header->width;
+    const int32_t height = dib_header->height;
+
+    // A region is decoded into a scratch row that only has its columns copied out,
+    // stored rows above the top of the region are never needed
+    const bool is_cropped = region.x != 0 || region.y != 0 || region.width != width || region.height != height || downscale != 1;
+    const int32_t end_y = height - region.y;
+    const int32_t first_y = is_cropped ? height - region.y - region.height : 0;
+    std::vector<uint8_t> scratch_row(is_cropped ? (size_t)width * channels : 0);
+    RowDownscaler downscaler(downscale != 1 ? region.width : 0, channels, downscale);
+
+    // The first stored row is the bottom one
+    int32_t x = 0;
+    int32_t y = 0;
+
+    auto row_output = [&](int32_t row)
+    {
+      return is_cropped ? scratch_row.data() : output + (size_t)(height - 1 - row) * output_stride;
+    };
+
+    auto finish_row = [&]()
+    {
+      const int32_t top_y = height - 1 - y;
+      if (!is_cropped || top_y < region.y || top_y >= region.y + region.height)
+        return;
+
+      const int32_t region_y = top_y - region.y;
+      const uint8_t *region_ptr = scratch_row.data() + (size_t)region.x * channels;
+      if (downscale == 1)
+      {
+        std::memcpy(output + (size_t)region_y * output_stride, region_ptr, (size_t)region.width * channels);
+        return;
+      }
+
+      // Rows arrive bottom up, so the top row of a block is the last one it gets
+      downscaler.addRow(region_ptr);
+      if (region_y % (int32_t)downscale == 0)
+        downscaler.flush(output + (size_t)(region_y / (int32_t)downscale) * output_stride);
+    };
+
+    uint8_t *output_ptr = row_output(0);
+
+    // Pixels that are skipped by a delta or end of line keep the color of index 0,
+    // rows below the region are never copied out, so they are passed in one step
+    auto skip_to = [&](int32_t target_x, int32_t target_y)
+    {
+      if (y < first_y && y < target_y)
+      {
+        x = 0;
+        y = std::min(target_y, first_y);
+        output_ptr = row_output(y);
+      }
+
+      while (y < target_y || (y == target_y && x < target_x))
+      {
+        const int32_t end_x = y < target_y ? width : target_x;
+        if (end_x > x && (!is_cropped || height - 1 - y < region.y + region.height))
+        {
+          std::memcpy(output_ptr + x * channels, colors, channels);
+          fillPattern(output_ptr + x * channels, channels, (size_t)(end_x - x) * channels);
+        }
+        x = end_x;
 
-    for (int32_t y = dib_header->height - 1; y >= 0; y--)
+        if (y < target_y)
+        {
+          finish_row();
+          x = 0;
+          y++;
+          if (y < height)
+            output_ptr = row_output(y);
+        }
+      }
+    };
+
+    while (y < end_y)
     {
+      if (pos + 2 > data_size)
+        throw std::runtime_error("input image RLE data is truncated");
+
+      const uint8_t count = data[pos];
+      const uint8_t value = data[pos + 1];
+      pos += 2;
 
-      for (int32_t x = 0; x < dib_header->width; x++)
+      if (count > 0)
       {
-        const uint32_t *pixel_ptr = reinterpret_cast<const uint32_t *>(inputImage.data() + bmp_header->data_offset + y * dib_header->meta.padded_row_width + x * bytes_per_pixel);
+        // Encoded run, clipped at the end of the row
+        const int32_t run = std::min<int32_t>(count, width - x);
+        if (run <= 0)
+          continue;
+
+        uint8_t *run_ptr = output_ptr + x * channels;
+        if (is_rle4)
+        {
+          // Alternates between the high and the low nibble
+          std::memcpy(run_ptr, colors + (value >> 4) * channels, channels);
+          if (run > 1)
+          {
+            std::memcpy(run_ptr + channels, colors + (value & 0x0f) * channels, channels);
+            fillPattern(run_ptr, channels * 2, (size_t)run * channels);
+          }
+        }
+        else
+        {
+          std::memcpy(run_ptr, colors + value * channels, channels);
+          fillPattern(run_ptr, channels, (size_t)run * channels);
+        }
+
+        x += run;
+        continue;
+      }
 
-        const float red_unscaled = (float)((*pixel_ptr >> masks.red_shift) & masks.red_mask);
-        decoded_data[decoded_data_pos++] = (uint8_t)(red_unscaled * masks.red_scale);
+      switch (value)
+      {
+      case 0:
+      {
+        // End of line
+        skip_to(0, y + 1);
+        break;
+      }
+
+      case 1:
+      {
+        // End of bitmap
+        skip_to(0, end_y);
+        break;
+      }
+
+      case 2:
+      {
+        // Delta, moves the position right and up
+        if (pos + 2 > data_size)
+          throw std::runtime_error("input image RLE data is truncated");
+
+        const int32_t target_x = x + data[pos];
+        const int32_t target_y = y + data[pos + 1];
+        pos += 2;
+
+        if (target_x > width || target_y >= height)
+          throw std::runtime_error("input image RLE delta is out of bounds");
+
+        skip_to(target_x, target_y);
+        break;
+      }
 
-        const float green_unscaled = (float)((*pixel_ptr >> masks.green_shift) & masks.green_mask);
-        decoded_data[decoded_data_pos++] = (uint8_t)(green_unscaled * masks.green_scale);
+      default:
+      {
+        // Absolute mode, value is the amount of literal pixels, padded to 16 bits
+        const uint32_t literal_bytes = is_rle4 ? (value + 1u) / 2u : value;
+        if (pos + literal_bytes > data_size)
+          throw std::runtime_error("input image RLE data is truncated");
 
-        const float blue_unscaled = (float)((*pixel_ptr >> masks.blue_shift) & masks.blue_mask);
-        decoded_data[decoded_data_pos++] = (uint8_t)(blue_unscaled * masks.blue_scale);
+        const uint8_t *literal_ptr = data + pos;
+        const int32_t literal_count = std::min<int32_t>(value, width - x);
+        uint8_t *literal_output_ptr = output_ptr + x * channels;
 
-        if (dib_header->meta.has_alpha_channel)
+        for (int32_t i = 0; i < literal_count; i++)
         {
-          const float alpha_unscaled = (float)((*pixel_ptr >> masks.alpha_shift) & masks.alpha_mask);
-          decoded_data[decoded_data_pos++] = (uint8_t)(alpha_unscaled * masks.alpha_scale);
+          const uint8_t index = is_rle4 ? (uint8_t)((literal_ptr[i / 2] >> ((i % 2) ? 0 : 4)) & 0x0f) : literal_ptr[i];
+          std::memcpy(literal_output_ptr, colors + index * channels, channels);
+          literal_output_ptr += channels;
         }
+
+        if (literal_count > 0)
+          x += literal_count;
+        pos += (literal_bytes + 1) & ~1u;
+        break;
+      }
+      }
+    }
+  }
+
+  bmp::RowDownscaler::RowDownscaler(int32_t width, uint8_t channels, uint32_t downscale)
+      : width(width), channels(channels), downscale((int32_t)downscale),
+        column_sums((size_t)width * channels), row((size_t)width * channels)
+  {
+    switch (channels)
+    {
+    case 1:
+      flush_row = selectDownscaleRow<1>(downscale);
+      break;
+    case 3:
+      flush_row = selectDownscaleRow<3>(downscale);
+      break;
+    default:
+      flush_row = selectDownscaleRow<4>(downscale);
+      break;
+    }
+  }
+
+  void bmp::RowDownscaler::addRow(const uint8_t *row_ptr)
+  {
+    // A plain widening add over the whole row, which the compiler vectorizes
+    const size_t row_size = column_sums.size();
+    uint16_t *sums = column_sums.data();
+    for (size_t i = 0; i < row_size; i++)
+      sums[i] = (uint16_t)(sums[i] + row_ptr[i]);
+    rows++;
+  }
+
+  void bmp::RowDownscaler::flush(uint8_t *output_ptr)
+  {
+    flush_row(column_sums.data(), width, rows, output_ptr);
+    rows = 0;
+  }
+
+  template <uint8_t Channels>
+  void (*bmp::selectDownscaleRow(uint32_t downscale))(uint16_t *column_sums, int32_t width, int32_t rows, uint8_t *output_ptr)
+  {
+    switch (downscale)
+    {
+    case 2:
+      return flushDownscaleRow<Channels, 2>;
+    case 4:
+      return flushDownscaleRow<Channels, 4>;
+    default:
+      return flushDownscaleRow<Channels, 8>;
+    }
+  }
+
+  template <uint8_t Channels, int32_t Downscale>
+  void bmp::flushDownscaleRow(uint16_t *column_sums, int32_t width, int32_t rows, uint8_t *output_ptr)
+  {
+    // Dividing by a multiply with the rounded up reciprocal is exact, as every sum is below 2^16 and a count at most 64
+    const int32_t full_blocks = width / Downscale;
+    const uint32_t count = (uint32_t)(rows * Downscale);
+    const uint64_t reciprocal = ((1ull << 32) + count - 1) / count;
+
+    uint16_t *sums = column_sums;
+    for (int32_t block = 0; block < full_blocks; block++)
+    {
+      for (uint8_t c = 0; c < Channels; c++)
+      {
+        uint32_t sum = 0;
+        for (int32_t i = 0; i < Downscale; i++)
+          sum += sums[i * Channels + c];
+        *output_ptr++ = (uint8_t)(((sum + count / 2) * reciprocal) >> 32);
       }
+      sums += Downscale * Channels;
     }
 
-    return std::make_pair(decoded_data, description);
+    // The last block of a row can be narrower
+    const int32_t last_columns = width - full_blocks * Downscale;
+    if (last_columns > 0)
+    {
+      const uint32_t last_count = (uint32_t)(rows * last_columns);
+      for (uint8_t c = 0; c < Channels; c++)
+      {
+        uint32_t sum = 0;
+        for (int32_t i = 0; i < last_columns; i++)
+          sum += sums[i * Channels + c];
+        *output_ptr++ = (uint8_t)((sum + last_count / 2) / last_count);
+      }
+    }
+
+    std::memset(column_sums, 0, (size_t)width * Channels * sizeof(uint16_t));
+  }
+
+  void bmp::fillPattern(uint8_t *output_ptr, size_t pattern_size, size_t total_size)
+  {
+    // The first pattern is already written, keep doubling it until the span is full
+    size_t filled = std::min(pattern_size, total_size);
+    while (filled < total_size)
+    {
+      const size_t copy_size = std::min(filled, total_size - filled);
+      std::memcpy(output_ptr + filled, output_ptr, copy_size);
+      filled += copy_size;
+    }
+  }
+
+  template <PixelFormat Format>
+  bmp::PixelRow bmp::selectPixelRow(uint32_t bytes_per_pixel, bool has_alpha_channel, bool has_canonical_masks)
+  {
+    // Formats without alpha never read it
+    if constexpr (Format == PixelFormat::RGB8 || Format == PixelFormat::GRAY8)
+      has_alpha_channel = false;
+
+    if (has_canonical_masks)
+    {
+      if (bytes_per_pixel == 3)
+        return decodeCanonicalRow<3, Format, false>;
+      return has_alpha_channel ? decodeCanonicalRow<4, Format, true> : decodeCanonicalRow<4, Format, false>;
+    }
+
+    // Should be divisible by 8 if reached here, not gonna check for speed
+    switch (bytes_per_pixel | (has_alpha_channel ? 0x10 : 0))
+    {
+    case 2:
+      return decodeMaskedRow<2, Format, false>;
+    case 3:
+      return decodeMaskedRow<3, Format, false>;
+    case 4:
+      return decodeMaskedRow<4, Format, false>;
+    case 0x12:
+      return decodeMaskedRow<2, Format, true>;
+    case 0x13:
+      return decodeMaskedRow<3, Format, true>;
+    default:
+      return decodeMaskedRow<4, Format, true>;
+    }
+  }
+
+  template <uint32_t BytesPerPixel, PixelFormat Format, bool HasAlpha>
+  void bmp::decodeCanonicalRow(const uint8_t *row_ptr, uint8_t *output_ptr, int32_t width, const RowDecoder &)
+  {
+    // Stored BGRA is already the output, nothing to convert
+    if constexpr (BytesPerPixel == 4 && Format == PixelFormat::BGRA8 && HasAlpha)
+    {
+      std::memcpy(output_ptr, row_ptr, (size_t)width * 4);
+      return;
+    }
+
+    // BGR(X) or BGRA, the channels only have to be moved
+    for (int32_t x = 0; x < width; x++)
+    {
+      storePixel<Format>(output_ptr, row_ptr[2], row_ptr[1], row_ptr[0], HasAlpha ? row_ptr[3] : 255);
+
+      row_ptr += BytesPerPixel;
+      output_ptr += pixelFormatChannels(Format);
+    }
+  }
+
+  template <uint32_t BytesPerPixel, PixelFormat Format, bool HasAlpha>
+  void bmp::decodeMaskedRow(const uint8_t *row_ptr, uint8_t *output_ptr, int32_t width, const RowDecoder &row_decoder)
+  {
+    const auto &masks = row_decoder.masks;
+
+    for (int32_t x = 0; x < width; x++)
+    {
+      // Only load the bytes of this pixel, so the last pixel never reads past the row
+      const uint8_t *pixel_ptr = row_ptr + x * BytesPerPixel;
+      uint32_t pixel = pixel_ptr[0] | (pixel_ptr[1] << 8);
+      if constexpr (BytesPerPixel >= 3)
+        pixel |= (uint32_t)pixel_ptr[2] << 16;
+      if constexpr (BytesPerPixel == 4)
+        pixel |= (uint32_t)pixel_ptr[3] << 24;
+
+      storePixel<Format>(
+          output_ptr,
+          masks.red_table[(pixel >> masks.red_shift) & masks.red_mask],
+          masks.green_table[(pixel >> masks.green_shift) & masks.green_mask],
+          masks.blue_table[(pixel >> masks.blue_shift) & masks.blue_mask],
+          HasAlpha ? masks.alpha_table[(pixel >> masks.alpha_shift) & masks.alpha_mask] : 255);
+
+      output_ptr += pixelFormatChannels(Format);
+    }
+  }
+
+  template <uint32_t BytesPerPixel, uint8_t Channels, bool HasAlpha>
+  void bmp::decodeWideRow(const uint8_t *row_ptr, uint8_t *output_ptr, int32_t width, const RowDecoder &row_decoder)
+  {
+    const auto &masks = row_decoder.wide_masks;
+
+    for (int32_t x = 0; x < width; x++)
+    {
+      // Only load the bytes of this pixel, so the last pixel never reads past the row
+      const uint8_t *pixel_ptr = row_ptr + x * BytesPerPixel;
+      uint32_t pixel = pixel_ptr[0] | (pixel_ptr[1] << 8);
+      if constexpr (BytesPerPixel >= 3)
+        pixel |= (uint32_t)pixel_ptr[2] << 16;
+      if constexpr (BytesPerPixel == 4)
+        pixel |= (uint32_t)pixel_ptr[3] << 24;
+
+      uint16_t channels[4];
+      for (uint8_t c = 0; c < Channels; c++)
+      {
+        const uint64_t value = (pixel >> masks.shift[c]) & masks.mask[c];
+        channels[c] = (uint16_t)((value * masks.multiplier[c] + (1ull << 31)) >> 32);
+      }
+      if constexpr (Channels == 4 && !HasAlpha)
+        channels[3] = 65535;
+
+      std::memcpy(output_ptr, channels, Channels * 2);
+      output_ptr += Channels * 2;
+    }
+  }
+
+  void bmp::widenRow(uint8_t *row_ptr, size_t values)
+  {
+    // Walks backwards, every uint16_t only overwrites bytes that were already widened
+    for (size_t i = values; i-- > 0;)
+    {
+      const uint16_t value = (uint16_t)(row_ptr[i] * 257);
+      std::memcpy(row_ptr + i * 2, &value, 2);
+    }
+  }
+
+  template <PixelFormat Format>
+  void bmp::storePixel(uint8_t *output_ptr, uint8_t red, uint8_t green, uint8_t blue, uint8_t alpha)
+  {
+    if constexpr (Format == PixelFormat::RGB8)
+    {
+      output_ptr[0] = red;
+      output_ptr[1] = green;
+      output_ptr[2] = blue;
+    }
+    else if constexpr (Format == PixelFormat::RGBA8)
+    {
+      output_ptr[0] = red;
+      output_ptr[1] = green;
+      output_ptr[2] = blue;
+      output_ptr[3] = alpha;
+    }
+    else if constexpr (Format == PixelFormat::BGRA8)
+    {
+      output_ptr[0] = blue;
+      output_ptr[1] = green;
+      output_ptr[2] = red;
+      output_ptr[3] = alpha;
+    }
+    else if constexpr (Format == PixelFormat::RGBA8_PREMULTIPLIED)
+    {
+      // Rounded color * alpha / 255 without a division
+      auto premultiply = [alpha](uint8_t color)
+      {
+        const uint32_t product = (uint32_t)color * alpha + 128;
+        return (uint8_t)((product + (product >> 8)) >> 8);
+      };
+
+      output_ptr[0] = premultiply(red);
+      output_ptr[1] = premultiply(green);
+      output_ptr[2] = premultiply(blue);
+      output_ptr[3] = alpha;
+    }
+    else
+    {
+      // BT.601 weights scaled to 256
+      output_ptr[0] = (uint8_t)((red * 77 + green * 150 + blue * 29 + 128) >> 8);
+    }
+  }
+
+  void bmp::storePixel(PixelFormat format, uint8_t *output_ptr, uint8_t red, uint8_t green, uint8_t blue, uint8_t alpha)
+  {
+    switch (format)
+    {
+    case PixelFormat::RGB8:
+      storePixel<PixelFormat::RGB8>(output_ptr, red, green, blue, alpha);
+      break;
+    case PixelFormat::RGBA8:
+      storePixel<PixelFormat::RGBA8>(output_ptr, red, green, blue, alpha);
+      break;
+    case PixelFormat::BGRA8:
+      storePixel<PixelFormat::BGRA8>(output_ptr, red, green, blue, alpha);
+      break;
+    case PixelFormat::RGBA8_PREMULTIPLIED:
+      storePixel<PixelFormat::RGBA8_PREMULTIPLIED>(output_ptr, red, green, blue, alpha);
+      break;
+    default:
+      storePixel<PixelFormat::GRAY8>(output_ptr, red, green, blue, alpha);
+      break;
+    }
   }
 
   bmp::DecodedRgbaMasks bmp::decodeMasks(DibDecodeHeader *dib_header)
@@ -158,15 +1150,56 @@ namespace bmpxx
     masks.blue_mask = (uint8_t)((1 << blue_width) - 1);
     masks.alpha_mask = (uint8_t)((1 << alpha_width) - 1);
 
-    masks.red_scale = 255.0f / masks.red_mask;
-    masks.green_scale = 255.0f / masks.green_mask;
-    masks.blue_scale = 255.0f / masks.blue_mask;
-    masks.alpha_scale = 255.0f / masks.alpha_mask;
+    fillScaleTable(masks.red_table, masks.red_mask);
+    fillScaleTable(masks.green_table, masks.green_mask);
+    fillScaleTable(masks.blue_table, masks.blue_mask);
+    fillScaleTable(masks.alpha_table, masks.alpha_mask);
 
     return masks;
   }
 
-  bmp::BmpHeader bmp::readBMPHeader(std::vector<uint8_t> inputImage)
+  bmp::WideMasks bmp::decodeWideMasks(DibDecodeHeader *dib_header)
+  {
+    auto masks = WideMasks();
+    const uint32_t rgba_masks[4] = {
+        dib_header->masks_rgba.red_mask,
+        dib_header->masks_rgba.green_mask,
+        dib_header->masks_rgba.blue_mask,
+        dib_header->masks_rgba.alpha_mask};
+
+    for (int c = 0; c < 4; c++)
+    {
+      // An empty mask only ever produces 0
+      if (rgba_masks[c] == 0)
+        continue;
+
+      const int rzero = std::countr_zero(rgba_masks[c]);
+      const int width = 32 - std::countl_zero(rgba_masks[c]) - rzero;
+      const int kept_width = std::min(width, 16);
+
+      masks.shift[c] = (uint8_t)(rzero + width - kept_width);
+      masks.mask[c] = (1u << kept_width) - 1;
+      // Exact for every value below 2^16, the rounding error stays under half a step
+      masks.multiplier[c] = ((65535ull << 32) + masks.mask[c] / 2) / masks.mask[c];
+    }
+
+    return masks;
+  }
+
+  void bmp::fillScaleTable(uint8_t *table, uint8_t mask)
+  {
+    // An empty mask only ever produces 0
+    if (mask == 0)
+      return;
+
+    // Uses the exact same float math as a per pixel conversion would,
+    // so the table gives bit identical results while the pixel loop stays integer only
+    const float scale = 255.0f / mask;
+    for (uint32_t value = 0; value <= mask; value++)
+      table[value] = (uint8_t)((float)value * scale);
+  }
+
+  bmp::BmpHeader bmp::readBMPHeader(std::span<const uint8_t> inputImage, uint64_t file_size)
   {
     // Check if the input image is large enough to contain the main header.
     if (inputImage.size() <= sizeof(BmpHeader) + sizeof(Dib12Header))
@@ -177,23 +1210,27 @@ namespace bmpxx
 
     if (!(
             std::memcmp(header.identifier, "BM", 2) == 0 ||
-            std::memcmp(header.identifier, "BA", 2) == 0 ||
             std::memcmp(header.identifier, "CI", 2) == 0 ||
             std::memcmp(header.identifier, "CP", 2) == 0 ||
             std::memcmp(header.identifier, "IC", 2) == 0 ||
             std::memcmp(header.identifier, "PT", 2) == 0))
+    {
+      if (std::memcmp(header.identifier, "BA", 2) == 0)
+        throw std::runtime_error("input image is a bitmap array, its entries are decoded with decodeArrayEntry");
       throw std::runtime_error("input image is not a BMP image");
+    }
 
-    if (header.file_size != inputImage.size())
+    if (header.file_size != file_size)
       throw std::runtime_error("input image size does not match file size");
 
     return header;
   }
 
-  uint32_t bmp::readDIBHeaderSize(std::vector<uint8_t> inputImage, BmpHeader *bmp_header)
+  uint32_t bmp::readDIBHeaderSize(std::span<const uint8_t> inputImage, uint64_t file_size, BmpHeader *bmp_header)
   {
     // First 4 bytes after BMP header are DIB header size
-    const uint32_t dib_header_size = *reinterpret_cast<const uint32_t *>(inputImage.data() + sizeof(BmpHeader));
+    uint32_t dib_header_size;
+    std::memcpy(&dib_header_size, inputImage.data() + sizeof(BmpHeader), sizeof(dib_header_size));
 
     // Check if the input image is large enough to contain the DIB header.
     if (inputImage.size() <= sizeof(BmpHeader) + dib_header_size)
@@ -203,15 +1240,15 @@ namespace bmpxx
     if (bmp_header->data_offset < sizeof(BmpHeader) + dib_header_size)
       throw std::runtime_error("input image data offset is too small");
 
-    if (bmp_header->data_offset > inputImage.size())
+    if (bmp_header->data_offset > file_size)
       throw std::runtime_error("input image data offset is too large");
 
     return dib_header_size;
   }
 
-  bmp::DibDecodeHeader bmp::readDIBHeader(std::vector<uint8_t> inputImage, BmpHeader *bmp_header)
+  bmp::DibDecodeHeader bmp::readDIBHeader(std::span<const uint8_t> inputImage, uint64_t file_size, BmpHeader *bmp_header)
   {
-    auto dib_header_size = readDIBHeaderSize(inputImage, bmp_header);
+    auto dib_header_size = readDIBHeaderSize(inputImage, file_size, bmp_header);
 
     auto dib_header = DibDecodeHeader(); // Pre populated
 
@@ -236,6 +1273,24 @@ namespace bmpxx
       dib_header.height = dib_header12->height;
       dib_header.planes = dib_header12->planes;
       dib_header.bits_per_pixel = dib_header12->bits_per_pixel;
+      // OS/2 1.x palettes always have every color
+      if (dib_header.bits_per_pixel <= 8)
+        dib_header.colors_used = 1u << dib_header.bits_per_pixel;
+      break;
+    }
+    case 16:
+    case 64:
+    {
+      // OS/2 2.x headers share their first 40 bytes with the Windows header, the 16 byte one stops after the bit depth
+      std::memcpy(&dib_header, inputImage.data() + sizeof(BmpHeader), std::min<size_t>(dib_header_size, sizeof(Dib40Header)));
+      dib_header.header_size = dib_header_size;
+
+      // 3 and 4 are Huffman 1D and 24 bit run length encoding on OS/2, not masks
+      if (dib_header.compression == BI_BITFIELDS || dib_header.compression == BI_JPEG)
+        throw std::runtime_error("input image compression is not supported");
+
+      if (dib_header.colors_used == 0 && dib_header.bits_per_pixel <= 8)
+        dib_header.colors_used = 1u << dib_header.bits_per_pixel;
       break;
     }
     default:
@@ -244,53 +1299,99 @@ namespace bmpxx
     }
     }
 
+    // A negative height marks rows that are stored top down,
+    // the lowest value has no positive counterpart and fails the size check below
+    const bool is_top_down = dib_header.height < 0;
+    if (is_top_down && dib_header.height != INT32_MIN)
+      dib_header.height = -dib_header.height;
+
     // This order is important
     fixDIBHeaderCompression(inputImage, &dib_header);
     fixDIBHeaderMasks(&dib_header);
 
     dib_header.meta = createDIBHeaderMeta(&dib_header);
+    dib_header.meta.is_top_down = is_top_down;
+    dib_header.meta.palette_entry_size = dib_header_size == sizeof(Dib12Header) ? 3 : 4;
     fixDIBHeaderDataSize(&dib_header);
 
-    if (inputImage.size() < bmp_header->data_offset + dib_header.data_size)
+    // Compressed images don't always store their data size, the rest of the file is used then
+    if (dib_header.data_size == 0)
+      dib_header.data_size = (uint32_t)(file_size - bmp_header->data_offset);
+
+    if (file_size < (uint64_t)bmp_header->data_offset + dib_header.data_size)
       throw std::runtime_error("input image is too small");
 
     // Check that the image has a normal size
     if (dib_header.width <= 0 || dib_header.height <= 0)
       throw std::runtime_error("input image width or height is invalid");
 
+    // Run length encoded rows are always stored bottom up
+    if (is_top_down && (dib_header.compression == BI_RLE8 || dib_header.compression == BI_RLE4))
+      throw std::runtime_error("input image compression can not be top down");
+
     // This must always be one
     if (dib_header.planes != 1)
       throw std::runtime_error("input image planes is not 1");
 
+    // Checked up front, so decoding itself can no longer fail
+    if (dib_header.bits_per_pixel <= 8)
+    {
+      if (dib_header.colors_used == 0 || dib_header.colors_used > 256)
+        throw std::runtime_error("input image colors used is invalid");
+
+      // Check if the data_offset is actually a valid position in the file
+      if (bmp_header->data_offset < sizeof(BmpHeader) + dib_header.header_size + dib_header.colors_used * dib_header.meta.palette_entry_size)
+        throw std::runtime_error("input image data offset is too small");
+    }
+
     return dib_header;
   }
 
   void bmp::fixDIBHeaderDataSize(DibDecodeHeader *dib_header)
   {
-    const uint32_t expected_data_size = dib_header->height * dib_header->meta.padded_row_width;
+    // Compressed data has no expected size, only the bounds check against the file applies
+    if (dib_header->compression == BI_RLE8 || dib_header->compression == BI_RLE4)
+      return;
+
+    // In 64 bits, a wrapped product would let a tiny file declare an enormous image
+    const uint64_t expected_data_size = (uint64_t)dib_header->height * dib_header->meta.padded_row_width;
+    if (expected_data_size > UINT32_MAX)
+      throw std::runtime_error("input image size does not match expected image size");
 
     if (dib_header->data_size == 0)
-      dib_header->data_size = expected_data_size;
+      dib_header->data_size = (uint32_t)expected_data_size;
 
     if (dib_header->data_size != expected_data_size)
       throw std::runtime_error("input image size does not match expected image size");
   }
 
-  void bmp::fixDIBHeaderCompression(std::vector<uint8_t> inputImage, DibDecodeHeader *dib_header)
+  void bmp::fixDIBHeaderCompression(std::span<const uint8_t> inputImage, DibDecodeHeader *dib_header)
   {
     // Ensure it uses a compatible compression
     if (
         dib_header->compression != BI_RGB &&
+        dib_header->compression != BI_RLE8 &&
+        dib_header->compression != BI_RLE4 &&
         dib_header->compression != BI_BITFIELDS &&
         dib_header->compression != BI_ALPHABITFIELDS)
       throw std::runtime_error("input image compression is not supported");
 
+    // Run length encoding is only defined for these bit depths
+    if ((dib_header->compression == BI_RLE8 && dib_header->bits_per_pixel != 8) ||
+        (dib_header->compression == BI_RLE4 && dib_header->bits_per_pixel != 4))
+      throw std::runtime_error("input image compression does not match its bits per pixel");
+
     if (dib_header->header_size <= sizeof(Dib40Header))
     {
+      // The masks are read straight from the input, so make sure they are actually there
+      const uint32_t masks_size = dib_header->compression == BI_ALPHABITFIELDS ? sizeof(RgbaMasks) : sizeof(RgbMasks);
+      if (inputImage.size() < sizeof(BmpHeader) + dib_header->header_size + masks_size)
+        throw std::runtime_error("input image is too small");
+
       // Merge bitfields into the dib header, since in some cases this is not done
       if (dib_header->compression == BI_BITFIELDS)
       {
-        auto rgb_masks = reinterpret_cast<RgbMasks *>(inputImage.data() + sizeof(BmpHeader) + dib_header->header_size);
+        auto rgb_masks = reinterpret_cast<const RgbMasks *>(inputImage.data() + sizeof(BmpHeader) + dib_header->header_size);
         auto target_masks = reinterpret_cast<RgbMasks *>(&dib_header->masks_rgba);
         std::memcpy(target_masks, rgb_masks, sizeof(RgbMasks));
         dib_header->header_size += sizeof(RgbMasks);
@@ -1,81 +1,533 @@
 #include "bmpxx.hpp"
 
+#include <algorithm>
 #include <cstdint>
 #include <cstring>
+#include <span>
 #include <vector>
 #include <stdexcept>
 #include <bit>
 
 namespace bmpxx
 {
-  std::vector<uint8_t> bmp::encode(std::vector<uint8_t> input, BmpDesc desc)
+  std::vector<uint8_t> bmp::encode(const std::vector<uint8_t> &input, BmpDesc desc, const EncodeOptions &options)
+  {
+    return encode(std::span<const uint8_t>(input), desc, options);
+  }
+
+  std::vector<uint8_t> bmp::encode(std::span<const uint8_t> input, BmpDesc desc, const EncodeOptions &options)
+  {
+    // A vector can not skip zero initializing
+    std::vector<uint8_t> output;
+    encodeTo(input, desc, options, [&](size_t size)
+    {
+      output.resize(size);
+      return output.data();
+    });
+    return output;
+  }
+
+  Buffer bmp::encode(std::span<const uint8_t> input, BmpDesc desc, std::pmr::memory_resource *memory_resource, const EncodeOptions &options)
+  {
+    Buffer output;
+    encodeTo(input, desc, options, [&](size_t size)
+    {
+      output = Buffer(size, memory_resource);
+      return output.data();
+    });
+    return output;
+  }
+
+  void bmp::encodeTo(std::span<const uint8_t> input, BmpDesc desc, const EncodeOptions &options, const AllocateOutput &allocate_output)
   {
     if (desc.channels != 3 && desc.channels != 4)
       throw std::runtime_error("Only 3 and 4 channels are supported");
+    if (desc.bit_depth != 8)
+      throw std::runtime_error("Only 8 bit channels are supported");
+    // Decoders reject empty images, and an empty palette reads as a full one
+    if (desc.width <= 0 || desc.height <= 0)
+      throw std::invalid_argument("Width and height have to be positive");
 
-    const uint32_t input_row_length = desc.width * desc.channels;
-    const uint32_t expected_input_length = desc.height * input_row_length;
+    const uint64_t input_row_length = (uint64_t)desc.width * desc.channels;
+    const uint64_t expected_input_length = (uint64_t)desc.height * input_row_length;
     if (input.size() != expected_input_length)
       throw std::invalid_argument("Input data size does not match the expected size.");
 
-    auto dib_header = createEncodeDibHeader(desc);
+    if (options.format == EncodeFormat::PALETTE || options.format == EncodeFormat::RLE)
+    {
+      encodePalette(input, desc, options, allocate_output);
+      return;
+    }
+
+    Instrumentation instrumentation;
+    StageTimer timer(options.instrument != nullptr);
+
+    auto dib_header = createEncodeDibHeader(desc, options.format, options.row_order);
+    instrumentation.header_ns = timer.lap();
+
+    // The output is not initialized, so the row padding is cleared explicitly
+    const size_t output_size = sizeof(BmpHeader) + dib_header.header_size + dib_header.data_size;
+    uint8_t *output = allocate_output(output_size);
+    uint8_t *pixels = output + sizeof(BmpHeader) + dib_header.header_size;
+    const size_t row_bytes = ((size_t)desc.width * dib_header.bits_per_pixel + 7) / 8;
+    instrumentation.allocation_ns = timer.lap();
+
+    instrumentation.threads = runRowBands(options.parallel, desc.height, desc.width, [&](int32_t first_row, int32_t end_row)
+    {
+      for (int32_t y = first_row; y < end_row; y++)
+      {
+        // Top down files store the input rows in order, bottom up files in reverse
+        const int32_t file_row = dib_header.meta.is_top_down ? y : desc.height - 1 - y;
+        const uint8_t *input_ptr = input.data() + (size_t)y * input_row_length;
+        uint8_t *output_ptr = pixels + (size_t)file_row * dib_header.meta.padded_row_width;
+        encodePixelRow(input_ptr, output_ptr, desc, options.format);
+        std::memset(output_ptr + row_bytes, 0, dib_header.meta.padded_row_width - row_bytes);
+      }
+    });
+
+    writeEncodeHeaders(&dib_header, output);
+
+    if (options.instrument)
+    {
+      const bool is_packed = options.format == EncodeFormat::RGB565 || options.format == EncodeFormat::RGB555;
+      instrumentation.row_ns = timer.lap();
+      instrumentation.row_path = is_packed ? "packed" : "native";
+      instrumentation.kernel = is_packed ? selectRowKernels().pack_isa : selectRowKernels().swizzle_isa;
+      reportInstrumentation(options.instrument, instrumentation, input.size(), output_size);
+    }
+  }
+
+  void bmp::encodePixelRow(const uint8_t *input_ptr, uint8_t *output_ptr, const BmpDesc &desc, EncodeFormat format)
+  {
+    const auto &kernels = selectRowKernels();
+
+    // The vector kernel does the bulk of the row, the scalar code the rest
+    if (format == EncodeFormat::RGB565 || format == EncodeFormat::RGB555)
+    {
+      const bool is_565 = format == EncodeFormat::RGB565;
+      if (desc.channels == 4)
+      {
+        const int32_t done = (is_565 ? kernels.pack_4_to_565 : kernels.pack_4_to_555)(input_ptr, output_ptr, desc.width);
+        if (is_565)
+          encodePackedRow<4, true>(input_ptr + done * 4, output_ptr + done * 2, desc.width - done);
+        else
+          encodePackedRow<4, false>(input_ptr + done * 4, output_ptr + done * 2, desc.width - done);
+      }
+      else
+      {
+        const int32_t done = (is_565 ? kernels.pack_3_to_565 : kernels.pack_3_to_555)(input_ptr, output_ptr, desc.width);
+        if (is_565)
+          encodePackedRow<3, true>(input_ptr + done * 3, output_ptr + done * 2, desc.width - done);
+        else
+          encodePackedRow<3, false>(input_ptr + done * 3, output_ptr + done * 2, desc.width - done);
+      }
+    }
+    else if (desc.channels == 4)
+    {
+      const int32_t done = kernels.swizzle_4_to_4(input_ptr, output_ptr, desc.width);
+      encodeRow<4>(input_ptr + done * 4, output_ptr + done * 4, desc.width - done);
+    }
+    else
+    {
+      const int32_t done = kernels.swizzle_3_to_3(input_ptr, output_ptr, desc.width);
+      encodeRow<3>(input_ptr + done * 3, output_ptr + done * 3, desc.width - done);
+    }
+  }
+
+  void bmp::encodePalette(std::span<const uint8_t> input, BmpDesc desc, const EncodeOptions &options, const AllocateOutput &allocate_output)
+  {
+    Instrumentation instrumentation;
+    StageTimer timer(options.instrument != nullptr);
+    const size_t pixel_count = (size_t)desc.width * desc.height;
+
+    // Counting has to see every pixel before the bit depth is known, so the indices are kept
+    std::vector<uint8_t> indices(pixel_count);
+    RgbaColor palette[256];
+    const uint32_t colors_used = desc.channels == 4
+                                     ? indexColors<4>(input.data(), pixel_count, indices.data(), palette)
+                                     : indexColors<3>(input.data(), pixel_count, indices.data(), palette);
+
+    instrumentation.table_ns = timer.lap();
+
+    auto dib_header = createEncodeDibHeader(desc, options.format, options.row_order, colors_used);
+    const size_t palette_size = colors_used * sizeof(RgbaColor);
+    instrumentation.header_ns = timer.lap();
+
+    // The size of run length encoded data is only known once it is written
+    if (options.format == EncodeFormat::RLE)
+    {
+      std::vector<uint8_t> rle_data;
+      encodeRle(indices.data(), desc, dib_header.compression == BI_RLE4, rle_data);
+      if (encodedFileSize(&dib_header, rle_data.size()) > UINT32_MAX)
+        throw std::runtime_error("Encoded image would be larger than 4 GB");
+      dib_header.data_size = (uint32_t)rle_data.size();
+      instrumentation.row_ns = timer.lap();
+
+      const size_t output_size = sizeof(BmpHeader) + dib_header.header_size + palette_size + rle_data.size();
+      uint8_t *output = allocate_output(output_size);
+      instrumentation.allocation_ns = timer.lap();
+
+      writeEncodeHeaders(&dib_header, output);
+      std::memcpy(output + sizeof(BmpHeader) + dib_header.header_size, palette, palette_size);
+      std::memcpy(output + sizeof(BmpHeader) + dib_header.header_size + palette_size, rle_data.data(), rle_data.size());
+
+      if (options.instrument)
+      {
+        instrumentation.row_ns += timer.lap();
+        instrumentation.row_path = "rle";
+        reportInstrumentation(options.instrument, instrumentation, input.size(), output_size);
+      }
+      return;
+    }
+
+    // The output is not initialized, so the row padding is cleared explicitly
+    const size_t output_size = sizeof(BmpHeader) + dib_header.header_size + palette_size + dib_header.data_size;
+    uint8_t *output = allocate_output(output_size);
+    std::memcpy(output + sizeof(BmpHeader) + dib_header.header_size, palette, palette_size);
+    uint8_t *pixels = output + sizeof(BmpHeader) + dib_header.header_size + palette_size;
+    const size_t row_bytes = ((size_t)desc.width * dib_header.bits_per_pixel + 7) / 8;
+    instrumentation.allocation_ns = timer.lap();
+
+    instrumentation.threads = runRowBands(options.parallel, desc.height, desc.width, [&](int32_t first_row, int32_t end_row)
+    {
+      for (int32_t y = first_row; y < end_row; y++)
+      {
+        const int32_t file_row = dib_header.meta.is_top_down ? y : desc.height - 1 - y;
+        const uint8_t *indices_ptr = indices.data() + (size_t)y * desc.width;
+        uint8_t *output_ptr = pixels + (size_t)file_row * dib_header.meta.padded_row_width;
+
+        switch (dib_header.bits_per_pixel)
+        {
+        case 1:
+          encodeIndexRow<1>(indices_ptr, output_ptr, desc.width);
+          break;
+        case 4:
+          encodeIndexRow<4>(indices_ptr, output_ptr, desc.width);
+          break;
+        default:
+          encodeIndexRow<8>(indices_ptr, output_ptr, desc.width);
+          break;
+        }
+        std::memset(output_ptr + row_bytes, 0, dib_header.meta.padded_row_width - row_bytes);
+      }
+    });
+
+    writeEncodeHeaders(&dib_header, output);
+
+    if (options.instrument)
+    {
+      instrumentation.row_ns = timer.lap();
+      instrumentation.row_path = "palette";
+      reportInstrumentation(options.instrument, instrumentation, input.size(), output_size);
+    }
+  }
+
+  template <uint8_t Channels>
+  uint32_t bmp::indexColors(const uint8_t *input_ptr, size_t pixel_count, uint8_t *indices, RgbaColor *palette)
+  {
+    // Open addressing with room for 4 times the most colors a palette can have,
+    // keys have bit 24 set so 0 marks an empty slot
+    constexpr uint32_t slot_bits = 10;
+    uint32_t keys[1 << slot_bits] = {};
+    uint8_t values[1 << slot_bits];
+    uint32_t colors_used = 0;
+
+    // Runs of the same color are common, those skip the table
+    uint32_t last_key = 0;
+    uint8_t last_index = 0;
+
+    for (size_t i = 0; i < pixel_count; i++)
+    {
+      const uint8_t *pixel_ptr = input_ptr + i * Channels;
+      const uint32_t key = pixel_ptr[0] | (pixel_ptr[1] << 8) | (pixel_ptr[2] << 16) | (1 << 24);
+
+      if (key != last_key)
+      {
+        uint32_t slot = (key * 0x9e3779b1u) >> (32 - slot_bits);
+        while (keys[slot] != key && keys[slot] != 0)
+          slot = (slot + 1) & ((1 << slot_bits) - 1);
+
+        if (keys[slot] == 0)
+        {
+          if (colors_used == 256)
+            throw std::runtime_error("Input has more than 256 colors, it can not be stored as a palette");
+
+          keys[slot] = key;
+          values[slot] = (uint8_t)colors_used;
+          palette[colors_used] = RgbaColor{pixel_ptr[2], pixel_ptr[1], pixel_ptr[0], 0};
+          colors_used++;
+        }
 
-    std::vector<uint8_t> output(sizeof(BmpHeader) + dib_header.header_size + dib_header.data_size);
-    uint32_t output_pos = sizeof(BmpHeader) + dib_header.header_size;
-    uint32_t input_pos = (uint32_t)input.size() - input_row_length;
+        last_key = key;
+        last_index = values[slot];
+      }
+
+      indices[i] = last_index;
+    }
+
+    return colors_used;
+  }
+
+  void bmp::encodeRle(const uint8_t *indices, BmpDesc desc, bool is_rle4, std::vector<uint8_t> &output)
+  {
+    // Bytes the pixels of a literal take, absolute mode is only worth it when that beats encoded runs
+    auto literal_cost = [is_rle4](int32_t count)
+    { return is_rle4 ? (count + 1) / 2 : count; };
+
+    // Flat images shrink a lot, so this only avoids the first few reallocations
+    output.reserve(output.size() + (size_t)desc.width * desc.height / 4 + 64);
+
+    auto emit_run = [&](int32_t count, uint8_t index)
+    {
+      output.push_back((uint8_t)count);
+      output.push_back(is_rle4 ? (uint8_t)(index << 4 | index) : index);
+    };
 
-    for (int32_t y = dib_header.height - 1; y >= 0; y--)
+    for (int32_t y = desc.height - 1; y >= 0; y--)
     {
-      for (int32_t x = 0; x < (int32_t)input_row_length; x += desc.channels)
+      const uint8_t *row = indices + (size_t)y * desc.width;
+
+      int32_t x = 0;
+      while (x < desc.width)
       {
-        output[output_pos + x + 2] = input[input_pos + x + 0];
-        output[output_pos + x + 1] = input[input_pos + x + 1];
-        output[output_pos + x + 0] = input[input_pos + x + 2];
+        const int32_t run = findRun(row, x, std::min(desc.width, x + 255));
+        if (run > 1)
+        {
+          emit_run(run, row[x]);
+          x += run;
+          continue;
+        }
+
+        // Grow a literal until a run comes along that is cheaper to end it for,
+        // ending costs an encoded run and a new literal header, 4 bytes
+        const int32_t literal_end = std::min(desc.width, x + 255);
+        int32_t end = x + 1;
+        while (end < literal_end)
+        {
+          const int32_t next_run = findRun(row, end, literal_end);
+          if (next_run > 1 && literal_cost(next_run) > 4)
+            break;
+          end += next_run;
+        }
+
+        const int32_t count = end - x;
+        if (count < 3)
+        {
+          // 0, 1 and 2 are escape codes, so these have to be single pixel runs
+          for (; x < end; x++)
+            emit_run(1, row[x]);
+          continue;
+        }
+
+        // Absolute mode, padded to 16 bits
+        output.push_back(0);
+        output.push_back((uint8_t)count);
+        if (is_rle4)
+        {
+          for (int32_t i = 0; i < count; i += 2)
+            output.push_back((uint8_t)(row[x + i] << 4 | (i + 1 < count ? row[x + i + 1] : 0)));
+        }
+        else
+        {
+          output.insert(output.end(), row + x, row + end);
+        }
+        if (literal_cost(count) % 2)
+          output.push_back(0);
+
+        x = end;
+      }
+
+      // End of line, or end of bitmap after the top row
+      output.push_back(0);
+      output.push_back(y == 0 ? 1 : 0);
+    }
+  }
 
-        if (desc.channels == 4)
-          output[output_pos + x + 3] = input[input_pos + x + 3];
+  int32_t bmp::findRun(const uint8_t *indices, int32_t x, int32_t end)
+  {
+    // Compares 8 indices at a time, the first differing byte ends the run
+    const uint8_t index = indices[x];
+    const uint64_t pattern = index * 0x0101010101010101ull;
+
+    int32_t position = x + 1;
+    for (; position + 8 <= end; position += 8)
+    {
+      uint64_t word;
+      std::memcpy(&word, indices + position, 8);
+
+      const uint64_t difference = word ^ pattern;
+      if (difference)
+      {
+        if constexpr (std::endian::native == std::endian::little)
+          return position + std::countr_zero(difference) / 8 - x;
+        else
+          return position + std::countl_zero(difference) / 8 - x;
       }
-      output_pos += dib_header.meta.padded_row_width;
-      input_pos -= input_row_length;
     }
 
+    while (position < end && indices[position] == index)
+      position++;
+
+    return position - x;
+  }
+
+  template <uint32_t BitsPerPixel>
+  void bmp::encodeIndexRow(const uint8_t *indices, uint8_t *output_ptr, int32_t width)
+  {
+    if constexpr (BitsPerPixel == 8)
+    {
+      std::memcpy(output_ptr, indices, (size_t)width);
+      return;
+    }
+
+    // The first pixel goes into the most significant bits, a partial last byte is padded with zeros
+    constexpr int32_t pixels_per_byte = 8 / BitsPerPixel;
+    for (int32_t x = 0; x < width; x += pixels_per_byte)
+    {
+      uint8_t byte = 0;
+      for (int32_t pixel = 0; pixel < pixels_per_byte && x + pixel < width; pixel++)
+        byte |= (uint8_t)(indices[x + pixel] << (8 - (pixel + 1) * BitsPerPixel));
+      *output_ptr++ = byte;
+    }
+  }
+
+  void bmp::writeEncodeHeaders(DibEncodeHeader *dib_header, uint8_t *output)
+  {
+    const uint64_t file_size = encodedFileSize(dib_header, dib_header->data_size);
+    if (file_size > UINT32_MAX)
+      throw std::runtime_error("Encoded image would be larger than 4 GB");
+
     auto bmp_header = BmpHeader();
-    bmp_header.file_size = (uint32_t)output.size();
-    bmp_header.data_offset = sizeof(BmpHeader) + dib_header.header_size;
+    bmp_header.data_offset = (uint32_t)(file_size - dib_header->data_size);
+    bmp_header.file_size = (uint32_t)file_size;
 
-    std::memcpy(output.data(), &bmp_header, sizeof(BmpHeader));
-    std::memcpy(output.data() + sizeof(BmpHeader), &dib_header, dib_header.header_size);
+    std::memcpy(output, &bmp_header, sizeof(BmpHeader));
+    std::memcpy(output + sizeof(BmpHeader), dib_header, dib_header->header_size);
+  }
 
-    return output;
+  uint64_t bmp::encodedFileSize(const DibEncodeHeader *dib_header, uint64_t data_size)
+  {
+    return sizeof(BmpHeader) + (uint64_t)dib_header->header_size + (uint64_t)dib_header->colors_used * sizeof(RgbaColor) + data_size;
+  }
+
+  template <uint8_t Channels>
+  void bmp::encodeRow(const uint8_t *input_ptr, uint8_t *output_ptr, int32_t width)
+  {
+    // RGB or RGBA to BGR or BGRA, a pure byte swizzle
+    for (int32_t x = 0; x < width; x++)
+    {
+      output_ptr[0] = input_ptr[2];
+      output_ptr[1] = input_ptr[1];
+      output_ptr[2] = input_ptr[0];
+
+      if constexpr (Channels == 4)
+        output_ptr[3] = input_ptr[3];
+
+      input_ptr += Channels;
+      output_ptr += Channels;
+    }
   }
 
-  bmp::DibEncodeHeader bmp::createEncodeDibHeader(BmpDesc desc)
+  template <uint8_t Channels, bool Is565>
+  void bmp::encodePackedRow(const uint8_t *input_ptr, uint8_t *output_ptr, int32_t width)
+  {
+    // Keeps the top bits of every channel, the decoder scales them back up
+    for (int32_t x = 0; x < width; x++)
+    {
+      uint16_t pixel;
+      if constexpr (Is565)
+        pixel = (uint16_t)(((input_ptr[0] >> 3) << 11) | ((input_ptr[1] >> 2) << 5) | (input_ptr[2] >> 3));
+      else
+        pixel = (uint16_t)(((input_ptr[0] >> 3) << 10) | ((input_ptr[1] >> 3) << 5) | (input_ptr[2] >> 3));
+
+      output_ptr[0] = (uint8_t)pixel;
+      output_ptr[1] = (uint8_t)(pixel >> 8);
+
+      input_ptr += Channels;
+      output_ptr += 2;
+    }
+  }
+
+  bmp::DibEncodeHeader bmp::createEncodeDibHeader(BmpDesc desc, EncodeFormat format, RowOrder row_order, uint32_t colors_used)
   {
     if (desc.channels != 3 && desc.channels != 4)
       throw std::runtime_error("Only 3 and 4 channels are supported");
+    if (desc.bit_depth != 8)
+      throw std::runtime_error("Only 8 bit channels are supported");
 
     auto dib_header = DibEncodeHeader();
 
     dib_header.width = desc.width;
     dib_header.height = desc.height;
 
-    if (desc.channels == 4)
+    switch (format)
+    {
+    case EncodeFormat::PALETTE:
     {
-      dib_header.bits_per_pixel = 32;
+      dib_header.bits_per_pixel = colors_used <= 2 ? 1 : colors_used <= 16 ? 4 : 8;
+      dib_header.compression = BI_RGB;
+      dib_header.colors_used = colors_used;
+      break;
+    }
+
+    case EncodeFormat::RLE:
+    {
+      // The decoder only reads run length encoded rows bottom up
+      if (row_order == RowOrder::TOP_DOWN)
+        throw std::invalid_argument("Run length encoded images can not be top down");
+
+      dib_header.bits_per_pixel = colors_used <= 16 ? 4 : 8;
+      dib_header.compression = colors_used <= 16 ? BI_RLE4 : BI_RLE8;
+      dib_header.colors_used = colors_used;
+      break;
+    }
+
+    case EncodeFormat::RGB565:
+    case EncodeFormat::RGB555:
+    {
+      const bool is_565 = format == EncodeFormat::RGB565;
+      dib_header.bits_per_pixel = 16;
       dib_header.compression = BI_BITFIELDS;
-      dib_header.masks_rgba.red_mask = 0x00ff0000;
-      dib_header.masks_rgba.green_mask = 0x0000ff00;
-      dib_header.masks_rgba.blue_mask = 0x000000ff;
-      dib_header.masks_rgba.alpha_mask = 0xff000000;
+      dib_header.masks_rgba.red_mask = is_565 ? 0xf800 : 0x7c00;
+      dib_header.masks_rgba.green_mask = is_565 ? 0x07e0 : 0x03e0;
+      dib_header.masks_rgba.blue_mask = 0x001f;
+      break;
     }
-    else
+
+    default:
     {
-      dib_header.bits_per_pixel = 24;
-      dib_header.compression = BI_RGB;
+      if (desc.channels == 4)
+      {
+        dib_header.bits_per_pixel = 32;
+        dib_header.compression = BI_BITFIELDS;
+        dib_header.masks_rgba.red_mask = 0x00ff0000;
+        dib_header.masks_rgba.green_mask = 0x0000ff00;
+        dib_header.masks_rgba.blue_mask = 0x000000ff;
+        dib_header.masks_rgba.alpha_mask = 0xff000000;
+      }
+      else
+      {
+        dib_header.bits_per_pixel = 24;
+        dib_header.compression = BI_RGB;
+      }
+      break;
+    }
     }
 
     dib_header.meta = createDIBHeaderMeta(&dib_header);
-    dib_header.data_size = dib_header.meta.padded_row_width * desc.height;
+
+    // The file size is stored in 32 bits, run length encoded data is only checked once it is known
+    const uint64_t data_size = (uint64_t)dib_header.meta.padded_row_width * desc.height;
+    if (format != EncodeFormat::RLE && encodedFileSize(&dib_header, data_size) > UINT32_MAX)
+      throw std::runtime_error("Encoded image would be larger than 4 GB");
+    dib_header.data_size = (uint32_t)data_size;
+
+    // Only after the meta, the padding is computed from the positive height
+    if (row_order == RowOrder::TOP_DOWN)
+    {
+      dib_header.height = -desc.height;
+      dib_header.meta.is_top_down = 1;
+    }
 
     return dib_header;
   }
@@ -0,0 +1,94 @@
+#include "bmpxx.hpp"
+
+#include <cstdint>
+#include <span>
+#include <string>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace bmpxx
+{
+  bmp::MappedFile::MappedFile(const std::string &path, AccessHint hint)
+  {
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      throw std::runtime_error("input file could not be opened");
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0)
+    {
+      close(fd);
+      throw std::runtime_error("input file could not be read");
+    }
+
+    // An empty file can't be mapped, and is never a valid image either
+    if (file_stat.st_size == 0)
+    {
+      close(fd);
+      throw std::runtime_error("input image is too small");
+    }
+
+    void *address = mmap(nullptr, (size_t)file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps its own reference to the file
+    close(fd);
+
+    if (address == MAP_FAILED)
+      throw std::runtime_error("input file could not be mapped");
+
+    mapping = static_cast<const uint8_t *>(address);
+    mapping_size = (size_t)file_stat.st_size;
+
+    switch (hint)
+    {
+    case AccessHint::SEQUENTIAL:
+      madvise(address, mapping_size, MADV_SEQUENTIAL);
+      break;
+    case AccessHint::RANDOM:
+      madvise(address, mapping_size, MADV_RANDOM);
+      break;
+    case AccessHint::NORMAL:
+      break;
+    }
+  }
+
+  bmp::MappedFile::~MappedFile()
+  {
+    if (mapping)
+      munmap(const_cast<uint8_t *>(mapping), mapping_size);
+  }
+
+  bmp::MappedFile::MappedFile(MappedFile &&other) noexcept
+      : mapping(std::exchange(other.mapping, nullptr)), mapping_size(std::exchange(other.mapping_size, 0))
+  {
+  }
+
+  bmp::MappedFile &bmp::MappedFile::operator=(MappedFile &&other) noexcept
+  {
+    if (this != &other)
+    {
+      if (mapping)
+        munmap(const_cast<uint8_t *>(mapping), mapping_size);
+
+      mapping = std::exchange(other.mapping, nullptr);
+      mapping_size = std::exchange(other.mapping_size, 0);
+    }
+    return *this;
+  }
+
+  std::span<const uint8_t> bmp::MappedFile::data() const
+  {
+    return std::span<const uint8_t>(mapping, mapping_size);
+  }
+
+  std::pair<std::vector<uint8_t>, BmpDesc> bmp::decodeFile(const std::string &path, const DecodeOptions &options)
+  {
+    // readBMPHeader checks the stored file size against the mapping
+    const auto mapped_file = MappedFile(path, AccessHint::SEQUENTIAL);
+    return decode(mapped_file.data(), options);
+  }
+}
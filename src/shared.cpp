@@ -1,26 +1,151 @@
 #include "bmpxx.hpp"
 
+#include <chrono>
 #include <cstdint>
 #include <cstring>
+#include <functional>
+#include <memory_resource>
+#include <thread>
+#include <utility>
 #include <vector>
 #include <stdexcept>
 #include <bit>
 
 namespace bmpxx
 {
+  Buffer::Buffer(size_t size, std::pmr::memory_resource *memory_resource)
+      : buffer_size(size), memory_resource(memory_resource)
+  {
+    if (size)
+      buffer_data = static_cast<uint8_t *>(memory_resource->allocate(size));
+  }
+
+  Buffer::~Buffer()
+  {
+    release();
+  }
+
+  Buffer::Buffer(Buffer &&other) noexcept
+      : buffer_data(std::exchange(other.buffer_data, nullptr)),
+        buffer_size(std::exchange(other.buffer_size, 0)),
+        memory_resource(other.memory_resource)
+  {
+  }
+
+  Buffer &Buffer::operator=(Buffer &&other) noexcept
+  {
+    if (this != &other)
+    {
+      release();
+      buffer_data = std::exchange(other.buffer_data, nullptr);
+      buffer_size = std::exchange(other.buffer_size, 0);
+      memory_resource = other.memory_resource;
+    }
+    return *this;
+  }
+
+  void Buffer::release()
+  {
+    if (buffer_data)
+      memory_resource->deallocate(buffer_data, buffer_size);
+    buffer_data = nullptr;
+    buffer_size = 0;
+  }
+
   bmp::DibHeaderMeta bmp::createDIBHeaderMeta(Dib56Header *dib_header)
   {
     auto dib_header_meta = DibHeaderMeta();
 
-    // Padding rows
-    const uint32_t row_width_bits = dib_header->width * dib_header->bits_per_pixel;
-    const uint32_t row_padding_bits = (32 - (row_width_bits % 32)) % 32;
-    const uint32_t padded_row_width_bytes = (row_width_bits + row_padding_bits) / 8;
+    // Padding rows, an invalid width is rejected by the callers afterwards
+    const uint64_t row_width_bits = dib_header->width > 0 ? (uint64_t)dib_header->width * dib_header->bits_per_pixel : 0;
+    const uint64_t row_padding_bits = (32 - (row_width_bits % 32)) % 32;
+    const uint64_t padded_row_width_bytes = (row_width_bits + row_padding_bits) / 8;
+
+    if (padded_row_width_bytes > UINT32_MAX)
+      throw std::runtime_error("image row is too large");
 
-    dib_header_meta.padded_row_width = padded_row_width_bytes;
+    dib_header_meta.padded_row_width = (uint32_t)padded_row_width_bytes;
     // Alpha
     dib_header_meta.has_alpha_channel = dib_header->masks_rgba.alpha_mask != 0;
+    // Canonical masks
+    dib_header_meta.has_canonical_masks =
+        (dib_header->bits_per_pixel == 24 || dib_header->bits_per_pixel == 32) &&
+        dib_header->masks_rgba.red_mask == 0x00ff0000 &&
+        dib_header->masks_rgba.green_mask == 0x0000ff00 &&
+        dib_header->masks_rgba.blue_mask == 0x000000ff &&
+        (dib_header->masks_rgba.alpha_mask == 0 || dib_header->masks_rgba.alpha_mask == 0xff000000);
 
     return dib_header_meta;
   }
+
+  uint32_t bmp::runRowBands(
+      const ParallelOptions &options,
+      int32_t rows,
+      int32_t row_pixels,
+      const std::function<void(int32_t first_row, int32_t end_row)> &band)
+  {
+    uint32_t bands = options.threads == 0 ? std::thread::hardware_concurrency() : options.threads;
+
+    // Every row only depends on its own offset, so any split gives the same output
+    if ((uint64_t)rows * (uint64_t)row_pixels < options.min_parallel_pixels)
+      bands = 1;
+    if (bands > (uint32_t)rows)
+      bands = (uint32_t)rows;
+
+    if (bands <= 1)
+    {
+      band(0, rows);
+      return 1;
+    }
+
+    auto run_band = [&](uint32_t index)
+    {
+      const int32_t first_row = (int32_t)((uint64_t)rows * index / bands);
+      const int32_t end_row = (int32_t)((uint64_t)rows * (index + 1) / bands);
+      band(first_row, end_row);
+    };
+
+    if (options.executor)
+    {
+      options.executor(bands, run_band);
+      return bands;
+    }
+
+    // The calling thread takes the first band itself
+    std::vector<std::thread> workers;
+    workers.reserve(bands - 1);
+    for (uint32_t index = 1; index < bands; index++)
+      workers.emplace_back(run_band, index);
+
+    run_band(0);
+
+    for (auto &worker : workers)
+      worker.join();
+
+    return bands;
+  }
+
+  bmp::StageTimer::StageTimer(bool enabled)
+      : enabled(enabled)
+  {
+    if (enabled)
+      last_ns = elapsed();
+  }
+
+  uint64_t bmp::StageTimer::elapsed()
+  {
+    const uint64_t now_ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                std::chrono::steady_clock::now().time_since_epoch())
+                                .count();
+    const uint64_t lap_ns = now_ns - last_ns;
+    last_ns = now_ns;
+    return lap_ns;
+  }
+
+  void bmp::reportInstrumentation(const InstrumentCallback &instrument, Instrumentation &instrumentation, uint64_t bytes_in, uint64_t bytes_out)
+  {
+    instrumentation.bytes_in = bytes_in;
+    instrumentation.bytes_out = bytes_out;
+    instrument(instrumentation);
+  }
 }
@@ -0,0 +1,434 @@
+#include "bmpxx.hpp"
+
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BMPXX_SIMD_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define BMPXX_SIMD_NEON
+#endif
+
+namespace bmpxx
+{
+  namespace
+  {
+    // Used when there is no vector version, the scalar code then converts the whole row
+    int32_t skipRow(const uint8_t *, uint8_t *, int32_t)
+    {
+      return 0;
+    }
+
+#ifdef BMPXX_SIMD_X86
+
+    // ============================================================
+    // SSSE3
+    // ============================================================
+
+    __attribute__((target("ssse3"))) int32_t swizzle3To3Ssse3(const uint8_t *input_ptr, uint8_t *output_ptr, int32_t width)
+    {
+      // 5 pixels per step, the 16th byte is rewritten by the next step
+      const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 14, 13, 12, 15);
+
+      int32_t x = 0;
+      for (; x + 6 <= width; x += 5)
+      {
+        const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input_ptr + x * 3));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(output_ptr + x * 3), _mm_shuffle_epi8(pixels, shuffle));
+      }
+      return x;
+    }
+
+    __attribute__((target("ssse3"))) int32_t swizzle4To4Ssse3(const uint8_t *input_ptr, uint8_t *output_ptr, int32_t width)
+    {
+      const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+      int32_t x = 0;
+      for (; x + 4 <= width; x += 4)
+      {
+        const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input_ptr + x * 4));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(output_ptr + x * 4), _mm_shuffle_epi8(pixels, shuffle));
+      }
+      return x;
+    }
+
+    __attribute__((target("ssse3"))) int32_t swizzle4To3Ssse3(const uint8_t *input_ptr, uint8_t *output_ptr, int32_t width)
+    {
+      // 4 pixels per step, the last 4 stored bytes are rewritten by the next step
+      const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+      int32_t x = 0;
+      for (; x + 6 <= width; x += 4)
+      {
+        const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input_ptr + x * 4));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(output_ptr + x * 3), _mm_shuffle_epi8(pixels, shuffle));
+      }
+      return x;
+    }
+
+    // Same result as the float lookup table, 255.0f / 31 times v truncates to v * 255 / 31
+    __attribute__((target("ssse3"))) inline __m128i scale5Ssse3(__m128i value)
+    {
+      const __m128i scaled = _mm_mullo_epi16(value, _mm_set1_epi16(255));
+      return _mm_srli_epi16(_mm_mulhi_epu16(scaled, _mm_set1_epi16(8457)), 2);
+    }
+
+    // Same result as the float lookup table, except that 63 maps to 254 there, so that is mirrored
+    __attribute__((target("ssse3"))) inline __m128i scale6Ssse3(__m128i value)
+    {
+      const __m128i scaled = _mm_mullo_epi16(value, _mm_set1_epi16(255));
+      const __m128i result = _mm_srli_epi16(_mm_mulhi_epu16(scaled, _mm_set1_epi16(8323)), 3);
+      return _mm_add_epi16(result, _mm_cmpeq_epi16(value, _mm_set1_epi16(63)));
+    }
+
+    template <bool Is565>
+    __attribute__((target("ssse3"))) int32_t unpack16Ssse3(const uint8_t *input_ptr, uint8_t *output_ptr, int32_t width)
+    {
+      // Interleaves the 8 red/green pairs and 8 blues into 24 bytes of RGB
+      const __m128i shuffle_rg_low = _mm_setr_epi8(0, 1, -1, 2, 3, -1, 4, 5, -1, 6, 7, -1, 8, 9, -1, 10);
+      const __m128i shuffle_b_low = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+      const __m128i shuffle_rg_high = _mm_setr_epi8(11, -1, 12, 13, -1, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+      const __m128i shuffle_b_high = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, -1, -1, -1, -1, -1, -1);
+      const __m128i five_bits = _mm_set1_epi16(0x1f);
+      const __m128i zero = _mm_setzero_si128();
+
+      int32_t x = 0;
+      for (; x + 8 <= width; x += 8)
+      {
+        const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input_ptr + x * 2));
+
+        __m128i red, green;
+        if constexpr (Is565)
+        {
+          red = scale5Ssse3(_mm_srli_epi16(pixels, 11));
+          green = scale6Ssse3(_mm_and_si128(_mm_srli_epi16(pixels, 5), _mm_set1_epi16(0x3f)));
+        }
+        else
+        {
+          red = scale5Ssse3(_mm_and_si128(_mm_srli_epi16(pixels, 10), five_bits));
+          green = scale5Ssse3(_mm_and_si128(_mm_srli_epi16(pixels, 5), five_bits));
+        }
+        const __m128i blue = scale5Ssse3(_mm_and_si128(pixels, five_bits));
+
+        const __m128i red_green = _mm_unpacklo_epi8(_mm_packus_epi16(red, zero), _mm_packus_epi16(green, zero));
+        const __m128i blues = _mm_packus_epi16(blue, zero);
+
+        const __m128i low = _mm_or_si128(_mm_shuffle_epi8(red_green, shuffle_rg_low), _mm_shuffle_epi8(blues, shuffle_b_low));
+        const __m128i high = _mm_or_si128(_mm_shuffle_epi8(red_green, shuffle_rg_high), _mm_shuffle_epi8(blues, shuffle_b_high));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(output_ptr + x * 3), low);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(output_ptr + x * 3 + 16), high);
+      }
+      return x;
+    }
+
+    // Rescales 10 bit values in 16 bit lanes to 16 bits, round(v * 65535 / 1023) is 64v + round(63v / 1023),
+    // and (63v + 511) / 1023 is a multiply high by 32801 and a shift by 9 for every 10 bit value
+    __attribute__((target("ssse3"))) inline __m128i scale10Ssse3(__m128i value)
+    {
+      const __m128i rounded = _mm_add_epi16(_mm_mullo_epi16(value, _mm_set1_epi16(63)), _mm_set1_epi16(511));
+      const __m128i fraction = _mm_srli_epi16(_mm_mulhi_epu16(rounded, _mm_set1_epi16((short)0x8021)), 9);
+      return _mm_add_epi16(_mm_slli_epi16(value, 6), fraction);
+    }
+
+    template <uint8_t Channels, bool HasAlpha>
+    __attribute__((target("ssse3"))) int32_t unpack1010102Ssse3(const uint8_t *input_ptr, uint8_t *output_ptr, int32_t width)
+    {
+      // Drops the alpha of 2 RGBA16 pixels, the last 4 bytes are rewritten by the next store
+      const __m128i shuffle_rgb = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 8, 9, 10, 11, 12, 13, -1, -1, -1, -1);
+      const __m128i ten_bits = _mm_set1_epi32(0x3ff);
+
+      int32_t x = 0;
+      // RGB16 writes 4 bytes past the 8 pixels, so a pixel has to be left after them
+      for (; x + 8 + (Channels == 3 ? 1 : 0) <= width; x += 8)
+      {
+        const __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input_ptr + x * 4));
+        const __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input_ptr + x * 4 + 16));
+
+        const __m128i red = scale10Ssse3(_mm_packs_epi32(
+            _mm_and_si128(_mm_srli_epi32(low, 20), ten_bits), _mm_and_si128(_mm_srli_epi32(high, 20), ten_bits)));
+        const __m128i green = scale10Ssse3(_mm_packs_epi32(
+            _mm_and_si128(_mm_srli_epi32(low, 10), ten_bits), _mm_and_si128(_mm_srli_epi32(high, 10), ten_bits)));
+        const __m128i blue = scale10Ssse3(_mm_packs_epi32(_mm_and_si128(low, ten_bits), _mm_and_si128(high, ten_bits)));
+
+        // 2 bit alpha times 65535 / 3 is exact
+        __m128i alpha = _mm_set1_epi16(-1);
+        if constexpr (HasAlpha)
+          alpha = _mm_mullo_epi16(_mm_packs_epi32(_mm_srli_epi32(low, 30), _mm_srli_epi32(high, 30)), _mm_set1_epi16(21845));
+
+        const __m128i red_green_low = _mm_unpacklo_epi16(red, green);
+        const __m128i red_green_high = _mm_unpackhi_epi16(red, green);
+        const __m128i blue_alpha_low = _mm_unpacklo_epi16(blue, alpha);
+        const __m128i blue_alpha_high = _mm_unpackhi_epi16(blue, alpha);
+
+        const __m128i pixels[4] = {
+            _mm_unpacklo_epi32(red_green_low, blue_alpha_low),
+            _mm_unpackhi_epi32(red_green_low, blue_alpha_low),
+            _mm_unpacklo_epi32(red_green_high, blue_alpha_high),
+            _mm_unpackhi_epi32(red_green_high, blue_alpha_high)};
+
+        for (int i = 0; i < 4; i++)
+        {
+          if constexpr (Channels == 4)
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(output_ptr + x * 8 + i * 16), pixels[i]);
+          else
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(output_ptr + x * 6 + i * 12), _mm_shuffle_epi8(pixels[i], shuffle_rgb));
+        }
+      }
+      return x;
+    }
+
+    // Packs 4 pixels held as R | G << 8 | B << 16 in 32 bit lanes into 16 bit values in the low half of each lane
+    template <bool Is565>
+    __attribute__((target("ssse3"))) inline __m128i pack16LanesSsse3(__m128i pixels)
+    {
+      const __m128i red = _mm_and_si128(pixels, _mm_set1_epi32(0xf8));
+      const __m128i blue = _mm_and_si128(_mm_srli_epi32(pixels, 19), _mm_set1_epi32(0x1f));
+
+      if constexpr (Is565)
+      {
+        const __m128i green = _mm_and_si128(_mm_srli_epi32(pixels, 5), _mm_set1_epi32(0x7e0));
+        return _mm_or_si128(_mm_or_si128(_mm_slli_epi32(red, 8), green), blue);
+      }
+      else
+      {
+        const __m128i green = _mm_and_si128(_mm_srli_epi32(pixels, 6), _mm_set1_epi32(0x3e0));
+        return _mm_or_si128(_mm_or_si128(_mm_slli_epi32(red, 7), green), blue);
+      }
+    }
+
+    template <uint8_t Channels, bool Is565>
+    __attribute__((target("ssse3"))) int32_t pack16Ssse3(const uint8_t *input_ptr, uint8_t *output_ptr, int32_t width)
+    {
+      // RGB input is first spread out to one pixel per 32 bit lane
+      const __m128i spread = Channels == 3
+                                 ? _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1)
+                                 : _mm_setr_epi8(0, 1, 2, -1, 4, 5, 6, -1, 8, 9, 10, -1, 12, 13, 14, -1);
+      const __m128i gather = _mm_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1);
+
+      // 8 pixels per step, 3 channel input loads 4 bytes past the last pixel
+      const int32_t step_width = Channels == 3 ? 10 : 8;
+
+      int32_t x = 0;
+      for (; x + step_width <= width; x += 8)
+      {
+        const __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input_ptr + x * Channels));
+        const __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input_ptr + x * Channels + 4 * Channels));
+
+        const __m128i packed_low = _mm_shuffle_epi8(pack16LanesSsse3<Is565>(_mm_shuffle_epi8(low, spread)), gather);
+        const __m128i packed_high = _mm_shuffle_epi8(pack16LanesSsse3<Is565>(_mm_shuffle_epi8(high, spread)), gather);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(output_ptr + x * 2), _mm_unpacklo_epi64(packed_low, packed_high));
+      }
+      return x;
+    }
+
+    // ============================================================
+    // AVX2
+    // ============================================================
+
+    __attribute__((target("avx2"))) int32_t swizzle3To3Avx2(const uint8_t *input_ptr, uint8_t *output_ptr, int32_t width)
+    {
+      // Each lane swaps 4 pixels, the 24 valid bytes are then packed together
+      const __m256i shuffle = _mm256_setr_epi8(
+          2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, -1, -1, -1, -1,
+          2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, -1, -1, -1, -1);
+      const __m256i pack = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+
+      int32_t x = 0;
+      for (; x + 11 <= width; x += 8)
+      {
+        const __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input_ptr + x * 3));
+        const __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input_ptr + x * 3 + 12));
+        const __m256i pixels = _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+        const __m256i swapped = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(pixels, shuffle), pack);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(output_ptr + x * 3), swapped);
+      }
+      return x;
+    }
+
+    __attribute__((target("avx2"))) int32_t swizzle4To4Avx2(const uint8_t *input_ptr, uint8_t *output_ptr, int32_t width)
+    {
+      const __m256i shuffle = _mm256_setr_epi8(
+          2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+          2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+      int32_t x = 0;
+      for (; x + 8 <= width; x += 8)
+      {
+        const __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(input_ptr + x * 4));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(output_ptr + x * 4), _mm256_shuffle_epi8(pixels, shuffle));
+      }
+      return x;
+    }
+
+    __attribute__((target("avx2"))) int32_t swizzle4To3Avx2(const uint8_t *input_ptr, uint8_t *output_ptr, int32_t width)
+    {
+      const __m256i shuffle = _mm256_setr_epi8(
+          2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+          2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+      const __m256i pack = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+
+      int32_t x = 0;
+      for (; x + 11 <= width; x += 8)
+      {
+        const __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(input_ptr + x * 4));
+        const __m256i swapped = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(pixels, shuffle), pack);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(output_ptr + x * 3), swapped);
+      }
+      return x;
+    }
+
+#endif
+
+#ifdef BMPXX_SIMD_NEON
+
+    // ============================================================
+    // NEON
+    // ============================================================
+
+    int32_t swizzle3To3Neon(const uint8_t *input_ptr, uint8_t *output_ptr, int32_t width)
+    {
+      int32_t x = 0;
+      for (; x + 16 <= width; x += 16)
+      {
+        const uint8x16x3_t pixels = vld3q_u8(input_ptr + x * 3);
+        const uint8x16x3_t swapped = {{pixels.val[2], pixels.val[1], pixels.val[0]}};
+        vst3q_u8(output_ptr + x * 3, swapped);
+      }
+      return x;
+    }
+
+    int32_t swizzle4To4Neon(const uint8_t *input_ptr, uint8_t *output_ptr, int32_t width)
+    {
+      int32_t x = 0;
+      for (; x + 16 <= width; x += 16)
+      {
+        const uint8x16x4_t pixels = vld4q_u8(input_ptr + x * 4);
+        const uint8x16x4_t swapped = {{pixels.val[2], pixels.val[1], pixels.val[0], pixels.val[3]}};
+        vst4q_u8(output_ptr + x * 4, swapped);
+      }
+      return x;
+    }
+
+    int32_t swizzle4To3Neon(const uint8_t *input_ptr, uint8_t *output_ptr, int32_t width)
+    {
+      int32_t x = 0;
+      for (; x + 16 <= width; x += 16)
+      {
+        const uint8x16x4_t pixels = vld4q_u8(input_ptr + x * 4);
+        const uint8x16x3_t swapped = {{pixels.val[2], pixels.val[1], pixels.val[0]}};
+        vst3q_u8(output_ptr + x * 3, swapped);
+      }
+      return x;
+    }
+
+    template <uint8_t Channels, bool Is565>
+    int32_t pack16Neon(const uint8_t *input_ptr, uint8_t *output_ptr, int32_t width)
+    {
+      int32_t x = 0;
+      for (; x + 8 <= width; x += 8)
+      {
+        uint8x8_t red, green, blue;
+        if constexpr (Channels == 4)
+        {
+          const uint8x8x4_t pixels = vld4_u8(input_ptr + x * 4);
+          red = pixels.val[0];
+          green = pixels.val[1];
+          blue = pixels.val[2];
+        }
+        else
+        {
+          const uint8x8x3_t pixels = vld3_u8(input_ptr + x * 3);
+          red = pixels.val[0];
+          green = pixels.val[1];
+          blue = pixels.val[2];
+        }
+
+        uint16x8_t packed = vmovl_u8(vshr_n_u8(blue, 3));
+        if constexpr (Is565)
+        {
+          packed = vorrq_u16(packed, vshlq_n_u16(vmovl_u8(vshr_n_u8(green, 2)), 5));
+          packed = vorrq_u16(packed, vshlq_n_u16(vmovl_u8(vshr_n_u8(red, 3)), 11));
+        }
+        else
+        {
+          packed = vorrq_u16(packed, vshlq_n_u16(vmovl_u8(vshr_n_u8(green, 3)), 5));
+          packed = vorrq_u16(packed, vshlq_n_u16(vmovl_u8(vshr_n_u8(red, 3)), 10));
+        }
+        vst1q_u8(output_ptr + x * 2, vreinterpretq_u8_u16(packed));
+      }
+      return x;
+    }
+
+#endif
+  }
+
+  const bmp::RowKernels &bmp::selectRowKernels()
+  {
+    static const RowKernels kernels = []()
+    {
+      auto selected = RowKernels();
+      selected.swizzle_3_to_3 = skipRow;
+      selected.swizzle_4_to_4 = skipRow;
+      selected.swizzle_4_to_3 = skipRow;
+      selected.unpack_565 = skipRow;
+      selected.unpack_555 = skipRow;
+      selected.pack_3_to_565 = skipRow;
+      selected.pack_4_to_565 = skipRow;
+      selected.pack_3_to_555 = skipRow;
+      selected.pack_4_to_555 = skipRow;
+      selected.unpack_1010102_to_3 = skipRow;
+      selected.unpack_1010102_to_4 = skipRow;
+      selected.unpack_1010102_to_4_opaque = skipRow;
+
+#ifdef BMPXX_SIMD_X86
+      __builtin_cpu_init();
+
+      if (__builtin_cpu_supports("ssse3"))
+      {
+        selected.swizzle_3_to_3 = swizzle3To3Ssse3;
+        selected.swizzle_4_to_4 = swizzle4To4Ssse3;
+        selected.swizzle_4_to_3 = swizzle4To3Ssse3;
+        selected.unpack_565 = unpack16Ssse3<true>;
+        selected.unpack_555 = unpack16Ssse3<false>;
+        selected.pack_3_to_565 = pack16Ssse3<3, true>;
+        selected.pack_4_to_565 = pack16Ssse3<4, true>;
+        selected.pack_3_to_555 = pack16Ssse3<3, false>;
+        selected.pack_4_to_555 = pack16Ssse3<4, false>;
+        selected.unpack_1010102_to_3 = unpack1010102Ssse3<3, false>;
+        selected.unpack_1010102_to_4 = unpack1010102Ssse3<4, true>;
+        selected.unpack_1010102_to_4_opaque = unpack1010102Ssse3<4, false>;
+        selected.swizzle_isa = "ssse3";
+        selected.unpack_isa = "ssse3";
+        selected.pack_isa = "ssse3";
+      }
+
+      if (__builtin_cpu_supports("avx2"))
+      {
+        selected.swizzle_3_to_3 = swizzle3To3Avx2;
+        selected.swizzle_4_to_4 = swizzle4To4Avx2;
+        selected.swizzle_4_to_3 = swizzle4To3Avx2;
+        selected.swizzle_isa = "avx2";
+      }
+#endif
+
+#ifdef BMPXX_SIMD_NEON
+      // NEON is always there on aarch64
+      selected.swizzle_3_to_3 = swizzle3To3Neon;
+      selected.swizzle_4_to_4 = swizzle4To4Neon;
+      selected.swizzle_4_to_3 = swizzle4To3Neon;
+      selected.pack_3_to_565 = pack16Neon<3, true>;
+      selected.pack_4_to_565 = pack16Neon<4, true>;
+      selected.pack_3_to_555 = pack16Neon<3, false>;
+      selected.pack_4_to_555 = pack16Neon<4, false>;
+      selected.swizzle_isa = "neon";
+      selected.pack_isa = "neon";
+#endif
+
+      return selected;
+    }();
+
+    return kernels;
+  }
+}
@@ -0,0 +1,231 @@
+#include "bmpxx.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <span>
+#include <vector>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace bmpxx
+{
+  bmp::StreamDecoder::StreamDecoder(ReadCallback read_callback, uint64_t file_size, PixelFormat format)
+      : read_callback(std::move(read_callback)), file_size(file_size), format(format)
+  {
+    readHeaders();
+  }
+
+  bmp::StreamDecoder::StreamDecoder(std::istream &stream, PixelFormat format)
+      : format(format)
+  {
+    stream.seekg(0, std::ios::end);
+    const auto end = stream.tellg();
+    if (end < 0)
+      throw std::runtime_error("input stream is not seekable");
+    file_size = (uint64_t)end;
+
+    read_callback = [&stream](uint64_t offset, uint8_t *buffer, size_t size) -> size_t
+    {
+      stream.clear();
+      stream.seekg((std::streamoff)offset);
+      stream.read(reinterpret_cast<char *>(buffer), (std::streamsize)size);
+      return (size_t)stream.gcount();
+    };
+
+    readHeaders();
+  }
+
+  bmp::StreamDecoder::StreamDecoder(int fd, PixelFormat format)
+      : format(format)
+  {
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0)
+      throw std::runtime_error("input file can not be read");
+    file_size = (uint64_t)file_stat.st_size;
+
+    read_callback = [fd](uint64_t offset, uint8_t *buffer, size_t size) -> size_t
+    {
+      size_t done = 0;
+      while (done < size)
+      {
+        const ssize_t result = pread(fd, buffer + done, size - done, (off_t)(offset + done));
+        if (result <= 0)
+          break;
+        done += (size_t)result;
+      }
+      return done;
+    };
+
+    readHeaders();
+  }
+
+  void bmp::StreamDecoder::readHeaders()
+  {
+    // Large enough for the biggest DIB header, its masks and a full palette,
+    // whatever follows them is never looked at by the header readers
+    std::vector<uint8_t> header_data((size_t)std::min<uint64_t>(file_size, 2048));
+    if (read_callback(0, header_data.data(), header_data.size()) != header_data.size())
+      throw std::runtime_error("input image could not be read");
+
+    bmp_header = readBMPHeader(header_data, file_size);
+    dib_header = readDIBHeader(header_data, file_size, &bmp_header);
+    desc = describeImage(&dib_header, format);
+
+    // Rows of run length encoded data have no fixed position
+    if (dib_header.compression == BI_RLE8 || dib_header.compression == BI_RLE4)
+      throw std::runtime_error("input image compression can not be streamed");
+
+    row_decoder = std::make_unique<RowDecoder>();
+    prepareRowDecoder(header_data, &dib_header, resolvePixelFormat(&dib_header, format), row_decoder.get());
+
+    row_buffer.resize(dib_header.meta.padded_row_width);
+  }
+
+  BmpDesc bmp::StreamDecoder::description() const
+  {
+    return desc;
+  }
+
+  size_t bmp::StreamDecoder::rowSize() const
+  {
+    return (size_t)desc.width * desc.channels * desc.bit_depth / 8;
+  }
+
+  bool bmp::StreamDecoder::readRow(std::span<uint8_t> output)
+  {
+    if (next_row >= desc.height)
+      return false;
+
+    readRow(next_row, output);
+    next_row++;
+    return true;
+  }
+
+  void bmp::StreamDecoder::readRow(int32_t y, std::span<uint8_t> output)
+  {
+    if (y < 0 || y >= desc.height)
+      throw std::out_of_range("row is outside of the image");
+
+    if (output.size() < rowSize())
+      throw std::invalid_argument("output buffer is too small for a decoded row");
+
+    // Bmp rows are stored bottom up
+    const int32_t file_row = dib_header.meta.is_top_down ? y : desc.height - 1 - y;
+    const uint64_t row_offset = bmp_header.data_offset + (uint64_t)file_row * dib_header.meta.padded_row_width;
+    if (read_callback(row_offset, row_buffer.data(), row_buffer.size()) != row_buffer.size())
+      throw std::runtime_error("input image could not be read");
+
+    decodeRow(*row_decoder, row_buffer.data(), output.data());
+  }
+
+  bmp::StreamEncoder::StreamEncoder(WriteCallback write_callback, BmpDesc desc, RowOrder order)
+      : write_callback(std::move(write_callback)), desc(desc), order(order)
+  {
+    writeHeaders();
+  }
+
+  bmp::StreamEncoder::StreamEncoder(std::ostream &stream, BmpDesc desc, RowOrder order)
+      : desc(desc), order(order)
+  {
+    write_callback = [&stream](uint64_t offset, const uint8_t *buffer, size_t size) -> size_t
+    {
+      stream.seekp((std::streamoff)offset);
+      stream.write(reinterpret_cast<const char *>(buffer), (std::streamsize)size);
+      return stream ? size : 0;
+    };
+
+    writeHeaders();
+
+    // Writing the last byte sizes a file stream, so rows can be written in any order.
+    // Streams that can't seek past their end, like string streams, get every row zero filled instead
+    const uint8_t last_byte = 0;
+    if (write_callback(fileSize() - 1, &last_byte, 1) == 1)
+      return;
+
+    stream.clear();
+    for (int32_t y = 0; y < desc.height; y++)
+      if (write_callback(data_offset + (uint64_t)y * row_buffer.size(), row_buffer.data(), row_buffer.size()) != row_buffer.size())
+        throw std::runtime_error("output image could not be written");
+  }
+
+  bmp::StreamEncoder::StreamEncoder(int fd, BmpDesc desc, RowOrder order)
+      : desc(desc), order(order)
+  {
+    write_callback = [fd](uint64_t offset, const uint8_t *buffer, size_t size) -> size_t
+    {
+      size_t done = 0;
+      while (done < size)
+      {
+        const ssize_t result = pwrite(fd, buffer + done, size - done, (off_t)(offset + done));
+        if (result <= 0)
+          break;
+        done += (size_t)result;
+      }
+      return done;
+    };
+
+    writeHeaders();
+
+    // Sizing the file up front lets rows be written in any order without growing it piece by piece
+    if (ftruncate(fd, (off_t)fileSize()) != 0)
+      throw std::runtime_error("output file could not be resized");
+  }
+
+  void bmp::StreamEncoder::writeHeaders()
+  {
+    if (desc.width <= 0 || desc.height <= 0)
+      throw std::invalid_argument("Width and height have to be positive");
+
+    dib_header = createEncodeDibHeader(desc, EncodeFormat::NATIVE, RowOrder::BOTTOM_UP);
+    data_offset = sizeof(BmpHeader) + dib_header.header_size;
+
+    std::vector<uint8_t> header_data(data_offset);
+    writeEncodeHeaders(&dib_header, header_data.data());
+    if (write_callback(0, header_data.data(), header_data.size()) != header_data.size())
+      throw std::runtime_error("output image could not be written");
+
+    // The padding bytes at the end stay zero
+    row_buffer.resize(dib_header.meta.padded_row_width);
+  }
+
+  size_t bmp::StreamEncoder::rowSize() const
+  {
+    return (size_t)desc.width * desc.channels;
+  }
+
+  uint64_t bmp::StreamEncoder::fileSize() const
+  {
+    return (uint64_t)data_offset + dib_header.data_size;
+  }
+
+  bool bmp::StreamEncoder::writeRow(std::span<const uint8_t> input)
+  {
+    if (rows_written >= desc.height)
+      return false;
+
+    const int32_t y = order == RowOrder::TOP_DOWN ? rows_written : desc.height - 1 - rows_written;
+    writeRow(y, input);
+    rows_written++;
+    return true;
+  }
+
+  void bmp::StreamEncoder::writeRow(int32_t y, std::span<const uint8_t> input)
+  {
+    if (y < 0 || y >= desc.height)
+      throw std::out_of_range("row is outside of the image");
+
+    if (input.size() < rowSize())
+      throw std::invalid_argument("input row is too small");
+
+    encodePixelRow(input.data(), row_buffer.data(), desc, EncodeFormat::NATIVE);
+
+    // Bmp rows are stored bottom up
+    const uint64_t row_offset = data_offset + (uint64_t)(desc.height - 1 - y) * dib_header.meta.padded_row_width;
+    if (write_callback(row_offset, row_buffer.data(), row_buffer.size()) != row_buffer.size())
+      throw std::runtime_error("output image could not be written");
+  }
+}
@@ -1,4 +1,5 @@
 #include "bmpxx.hpp"
+#include "pipeline.hpp"
 
 #include <iostream>
 #include <iterator>
@@ -9,17 +10,21 @@
 
 int main(int ac, char **av)
 {
+  // Many files at once, see pipeline.cpp
+  if (ac >= 2 && std::string(av[1]) == "--batch")
+    return runPipeline(ac - 2, av + 2, av[0]);
+
   // Read first argument to string
   if (ac < 3)
   {
     std::cerr << "Usage: " << av[0] << " <input> <output> [width] [height] [channels]" << std::endl;
+    std::cerr << "       " << av[0] << " --batch <input directory | file list> <output directory> [options]" << std::endl;
     return 1;
   }
 
   std::string input_filename = av[1];
   std::string output_filename = av[2];
 
-  // Read file into vector<byte>
   std::ifstream file(input_filename, std::ios::binary);
   if (!file)
   {
@@ -27,13 +32,11 @@ int main(int ac, char **av)
     return 1;
   }
 
-  std::vector<uint8_t> inputImage((std::istreambuf_iterator<char>(file)),
-                                  (std::istreambuf_iterator<char>()));
-
   // if input ends with .bmp
   if (input_filename.size() > 4 && input_filename.substr(input_filename.size() - 4) == ".bmp")
   {
-    auto result = bmpxx::bmp::decode(inputImage);
+    // Decodes straight from a mapping of the file, it is never read into memory first
+    auto result = bmpxx::bmp::decodeFile(input_filename);
 
     std::vector<uint8_t> outputImage = result.first;
     bmpxx::BmpDesc description = result.second;
@@ -56,6 +59,10 @@ int main(int ac, char **av)
       return 1;
     }
 
+    // Read file into vector<byte>
+    std::vector<uint8_t> inputImage((std::istreambuf_iterator<char>(file)),
+                                    (std::istreambuf_iterator<char>()));
+
     bmpxx::BmpDesc description(std::stoi(av[3]), std::stoi(av[4]), (uint8_t)std::stoi(av[5]));
 
     std::vector<uint8_t> outputImage = bmpxx::bmp::encode(inputImage, description);
@@ -0,0 +1,353 @@
+#include "pipeline.hpp"
+#include "bmpxx.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace
+{
+  // A file on its way through the pipeline, data holds the input and later the output
+  struct Job
+  {
+    std::filesystem::path input;
+    std::filesystem::path output;
+    std::vector<uint8_t> data;
+  };
+
+  // Blocks producers while full, so only a bounded amount of files is ever in memory
+  template <typename T>
+  class BoundedQueue
+  {
+  public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+    void push(T item)
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      not_full.wait(lock, [&]
+                    { return items.size() < capacity; });
+      items.push_back(std::move(item));
+      not_empty.notify_one();
+    }
+
+    // Returns false once the queue is closed and empty
+    bool pop(T &item)
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      not_empty.wait(lock, [&]
+                     { return !items.empty() || closed; });
+      if (items.empty())
+        return false;
+
+      item = std::move(items.front());
+      items.pop_front();
+      not_full.notify_one();
+      return true;
+    }
+
+    // No more items will be pushed
+    void close()
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      closed = true;
+      not_empty.notify_all();
+    }
+
+  private:
+    size_t capacity;
+    bool closed = false;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+  };
+
+  // Runs every thread of a stage and waits for all of them
+  void runStage(uint32_t threads, const std::function<void()> &stage)
+  {
+    std::vector<std::thread> workers;
+    for (uint32_t i = 0; i < threads; i++)
+      workers.emplace_back(stage);
+    for (auto &worker : workers)
+      worker.join();
+  }
+
+  uint64_t elapsedNs(std::chrono::steady_clock::time_point start)
+  {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  bool parseFormat(const std::string &name, bmpxx::EncodeFormat &format)
+  {
+    if (name == "native")
+      format = bmpxx::EncodeFormat::NATIVE;
+    else if (name == "palette")
+      format = bmpxx::EncodeFormat::PALETTE;
+    else if (name == "rle")
+      format = bmpxx::EncodeFormat::RLE;
+    else if (name == "rgb565")
+      format = bmpxx::EncodeFormat::RGB565;
+    else if (name == "rgb555")
+      format = bmpxx::EncodeFormat::RGB555;
+    else
+      return false;
+    return true;
+  }
+
+  void printUsage(const char *program)
+  {
+    std::cerr << "Usage: " << program << " --batch <input directory | file list> <output directory>"
+              << " [--threads N] [--io-threads N] [--queue N] [--format native|palette|rle|rgb565|rgb555] [--raw]" << std::endl;
+  }
+}
+
+int runPipeline(int ac, char **av, const char *program)
+{
+  if (ac < 2)
+  {
+    printUsage(program);
+    return 1;
+  }
+
+  const std::filesystem::path input_path = av[0];
+  const std::filesystem::path output_directory = av[1];
+
+  uint32_t threads = std::max(1u, std::thread::hardware_concurrency());
+  uint32_t io_threads = 2;
+  size_t queue_size = 0;
+  bool raw = false;
+  bmpxx::EncodeOptions encode_options;
+
+  try
+  {
+    for (int i = 2; i < ac; i++)
+    {
+      const std::string option = av[i];
+      if (option == "--raw")
+        raw = true;
+      else if (i + 1 >= ac)
+        throw std::invalid_argument(option);
+      else if (option == "--threads")
+        threads = (uint32_t)std::max(1, std::stoi(av[++i]));
+      else if (option == "--io-threads")
+        io_threads = (uint32_t)std::max(1, std::stoi(av[++i]));
+      else if (option == "--queue")
+        queue_size = (size_t)std::max(1, std::stoi(av[++i]));
+      else if (option != "--format" || !parseFormat(av[++i], encode_options.format))
+        throw std::invalid_argument(option);
+    }
+  }
+  catch (const std::exception &)
+  {
+    printUsage(program);
+    return 1;
+  }
+
+  // Enough files in flight to keep every converting thread busy while the others are read and written
+  if (queue_size == 0)
+    queue_size = (size_t)threads * 2;
+
+  // A directory is walked for every .bmp in it, anything else is a list with one path per line
+  std::vector<Job> jobs;
+  std::error_code error;
+  if (std::filesystem::is_directory(input_path, error))
+  {
+    for (const auto &entry : std::filesystem::recursive_directory_iterator(input_path, error))
+      if (entry.is_regular_file() && entry.path().extension() == ".bmp")
+        jobs.push_back(Job{entry.path(), output_directory / std::filesystem::relative(entry.path(), input_path), {}});
+  }
+  else
+  {
+    std::ifstream list(input_path);
+    if (!list)
+    {
+      std::cerr << "Could not open file " << input_path.string() << std::endl;
+      return 1;
+    }
+
+    std::vector<std::filesystem::path> inputs;
+    std::string line;
+    while (std::getline(list, line))
+      if (!line.empty())
+        inputs.push_back(std::filesystem::absolute(line).lexically_normal());
+
+    // Outputs keep their path below the deepest directory every input is in,
+    // so equal file names in different directories stay apart
+    std::filesystem::path root = inputs.empty() ? std::filesystem::path() : inputs.front().parent_path();
+    for (const auto &input : inputs)
+      while (input.lexically_relative(root).empty() || *input.lexically_relative(root).begin() == "..")
+        root = root.parent_path();
+
+    for (const auto &input : inputs)
+      jobs.push_back(Job{input, output_directory / input.lexically_relative(root), {}});
+  }
+
+  if (raw)
+    for (auto &job : jobs)
+      job.output.replace_extension(".raw");
+
+  // Files listed twice would be written over each other, only the first one is converted
+  uint64_t duplicates = 0;
+  std::set<std::filesystem::path> outputs;
+  for (auto &job : jobs)
+  {
+    if (outputs.insert(job.output).second)
+      continue;
+
+    std::cerr << "Failed " << job.input.string() << ": same output as an earlier file" << std::endl;
+    job.output.clear();
+    duplicates++;
+  }
+  std::erase_if(jobs, [](const Job &job)
+                { return job.output.empty(); });
+
+  BoundedQueue<Job> read_queue(queue_size);
+  BoundedQueue<Job> write_queue(queue_size);
+
+  std::atomic<size_t> next_job = 0;
+  std::atomic<uint64_t> converted = 0;
+  std::atomic<uint64_t> failed = duplicates;
+  std::atomic<uint64_t> bytes_read = 0;
+  std::atomic<uint64_t> bytes_written = 0;
+  std::atomic<uint64_t> pixels = 0;
+  // Summed over the threads of every stage, shows which stage holds the others up
+  std::atomic<uint64_t> read_ns = 0;
+  std::atomic<uint64_t> convert_ns = 0;
+  std::atomic<uint64_t> write_ns = 0;
+
+  std::mutex error_mutex;
+  auto report_failure = [&](const Job &job, const char *what)
+  {
+    std::lock_guard<std::mutex> lock(error_mutex);
+    std::cerr << "Failed " << job.input.string() << ": " << what << std::endl;
+    failed++;
+  };
+
+  auto read_files = [&]()
+  {
+    for (size_t index = next_job++; index < jobs.size(); index = next_job++)
+    {
+      Job job = std::move(jobs[index]);
+      const auto read_start = std::chrono::steady_clock::now();
+
+      std::ifstream file(job.input, std::ios::binary | std::ios::ate);
+      if (!file)
+      {
+        report_failure(job, "could not open file");
+        continue;
+      }
+
+      job.data.resize((size_t)file.tellg());
+      file.seekg(0);
+      if (!file.read(reinterpret_cast<char *>(job.data.data()), (std::streamsize)job.data.size()))
+      {
+        report_failure(job, "could not read file");
+        continue;
+      }
+
+      read_ns += elapsedNs(read_start);
+      bytes_read += job.data.size();
+      read_queue.push(std::move(job));
+    }
+  };
+
+  auto convert_files = [&]()
+  {
+    // Reused for every file this thread converts, so its pages are only faulted in once
+    std::vector<uint8_t> decoded;
+    Job job;
+    while (read_queue.pop(job))
+    {
+      const auto convert_start = std::chrono::steady_clock::now();
+      try
+      {
+        if (raw)
+        {
+          auto result = bmpxx::bmp::decode(job.data);
+          pixels += (uint64_t)result.second.width * result.second.height;
+          job.data = std::move(result.first);
+        }
+        else
+        {
+          decoded.resize(bmpxx::bmp::probe(job.data).second);
+          auto description = bmpxx::bmp::decodeInto(job.data, decoded);
+          pixels += (uint64_t)description.width * description.height;
+          job.data = bmpxx::bmp::encode(decoded, description, encode_options);
+        }
+      }
+      catch (const std::exception &exception)
+      {
+        report_failure(job, exception.what());
+        continue;
+      }
+
+      convert_ns += elapsedNs(convert_start);
+      write_queue.push(std::move(job));
+    }
+  };
+
+  auto write_files = [&]()
+  {
+    Job job;
+    while (write_queue.pop(job))
+    {
+      const auto write_start = std::chrono::steady_clock::now();
+
+      std::error_code directory_error;
+      std::filesystem::create_directories(job.output.parent_path(), directory_error);
+
+      std::ofstream file(job.output, std::ios::binary);
+      if (!file || !file.write(reinterpret_cast<const char *>(job.data.data()), (std::streamsize)job.data.size()))
+      {
+        report_failure(job, "could not write file");
+        continue;
+      }
+
+      write_ns += elapsedNs(write_start);
+      bytes_written += job.data.size();
+      converted++;
+    }
+  };
+
+  const auto start = std::chrono::steady_clock::now();
+
+  // Every stage closes the queue behind it once all its threads are done, which ends the next stage
+  std::thread readers([&]
+                      { runStage(io_threads, read_files); read_queue.close(); });
+  std::thread converters([&]
+                         { runStage(threads, convert_files); write_queue.close(); });
+  runStage(io_threads, write_files);
+
+  readers.join();
+  converters.join();
+
+  const double seconds = (double)elapsedNs(start) / 1e9;
+  const double megabyte = 1024.0 * 1024.0;
+
+  std::cout << std::fixed << std::setprecision(2);
+  std::cout << "Converted " << converted << " of " << jobs.size() + duplicates << " files (" << failed << " failed) in " << seconds << " s" << std::endl;
+  std::cout << "Files: " << (double)converted / seconds << " files/s" << std::endl;
+  std::cout << "Pixels: " << (double)pixels / seconds / 1e6 << " Mpixels/s" << std::endl;
+  std::cout << "Read: " << (double)bytes_read / megabyte << " MB, " << (double)bytes_read / megabyte / seconds << " MB/s" << std::endl;
+  std::cout << "Written: " << (double)bytes_written / megabyte << " MB, " << (double)bytes_written / megabyte / seconds << " MB/s" << std::endl;
+  std::cout << "Busy: read " << (double)read_ns / 1e9 << " s, convert " << (double)convert_ns / 1e9 << " s, write " << (double)write_ns / 1e9
+            << " s (summed over " << io_threads << " read, " << threads << " convert and " << io_threads << " write threads)" << std::endl;
+
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+// Converts every bmp of a directory or file list, reading, converting and writing files at the same time
+// Takes the arguments after --batch, returns the exit code
+int runPipeline(int ac, char **av, const char *program);